@@ -0,0 +1,86 @@
+#!/bin/sh
+# synthetic workloads for make bench, written to stdout
+#
+#   gen.sh copies N          meta2.meta with its rules copied N times under
+#                            new names, a large input for the meta2 grammar
+#   gen.sh grammar R A       a grammar of R rules of A alternatives each,
+#                            grouped ten rules to a rule under one START
+#   gen.sh input R A BYTES   about BYTES of input for that grammar, a
+#                            reproducible pseudo-random mix of its words
+#   gen.sh nested N          a one rule grammar whose expression is N
+#                            parentheses deep, three calls per level
+set -e
+here=$(dirname "$0")
+
+case "$1" in
+copies)
+    # the rule names get an @ suffix once, then each copy numbers it
+    sed -e '/^\.SYNTAX/d' -e '/^\.END/d' \
+        -e 's/\<\(OUT1\|OUTPUT\|EX1\|EX2\|EX3\|ST\|PROGRAM\)\>/\1@/g' "$here/../meta2.meta" |
+    awk -v copies="$2" '{ rules = rules $0 "\n" } END {
+        print ".SYNTAX PROGRAMX0"
+        for(i = 0; i < copies; ++i) {
+            copy = rules
+            gsub(/@/, "X" i, copy)
+            printf "%s", copy
+        }
+        print ".END"
+    }'
+    ;;
+grammar)
+    # rule r matches the words "<letter>rxa;" for a < A, where the letter
+    # cycles through a-z; the ';' keeps any word from being a prefix of another
+    awk -v rules="$2" -v alts="$3" -v q="'" 'BEGIN {
+        letters = "abcdefghijklmnopqrstuvwxyz"
+        groups = int((rules + 9) / 10)
+        print ".SYNTAX START"
+        print "START = $ TOP " q ".END" q " .,"
+        line = "TOP = G0"
+        for(g = 1; g < groups; ++g) line = line " / G" g
+        print line " .,"
+        for(g = 0; g < groups; ++g) {
+            line = "G" g " = R" g * 10
+            for(r = g * 10 + 1; r < g * 10 + 10 && r < rules; ++r) line = line " / R" r
+            print line " .,"
+        }
+        for(r = 0; r < rules; ++r) {
+            word = substr(letters, r % 26 + 1, 1) r "x"
+            line = "R" r " = " q word "0;" q " .OUT(" q "R" r " 0" q ")"
+            for(a = 1; a < alts; ++a) line = line "\n    / " q word a ";" q " .OUT(" q "R" r " " a q ")"
+            print line " .,"
+        }
+        print ".END"
+    }'
+    ;;
+input)
+    # a fixed LCG rather than rand(), whose sequence differs between awks
+    awk -v rules="$2" -v alts="$3" -v bytes="$4" 'BEGIN {
+        letters = "abcdefghijklmnopqrstuvwxyz"
+        seed = 12345; len = 0; line = ""
+        while(len < bytes) {
+            seed = (seed * 69069 + 1) % 4294967296
+            r = int(seed / 65536) % rules
+            word = substr(letters, r % 26 + 1, 1) r "x" int(seed / 16) % alts ";"
+            line = line " " word
+            len += length(word) + 1
+            if(length(line) > 70) { print line; line = "" }
+        }
+        print line " .END"
+    }'
+    ;;
+nested)
+    awk -v depth="$2" -v q="'" 'BEGIN {
+        print ".SYNTAX A"
+        line = "A = "
+        for(i = 0; i < depth; ++i) line = line "("
+        line = line q "x" q
+        for(i = 0; i < depth; ++i) line = line ")"
+        print line " .,"
+        print ".END"
+    }'
+    ;;
+*)
+    echo "usage: gen.sh copies N | grammar RULES ALTS | input RULES ALTS BYTES | nested N" >&2
+    exit 2
+    ;;
+esac
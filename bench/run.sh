@@ -0,0 +1,36 @@
+#!/bin/sh
+# runs the make bench workloads and prints one line per workload and
+# engine: workload=NAME followed by the fields of the vm's -s line
+#
+#   run.sh VM NATIVE DIR
+#
+# VM is an optimized vm, NATIVE the meta2.meta parser built by meta2c and
+# DIR holds the files made by bench/gen.sh. The outputs of every engine
+# must agree, or the run fails.
+set -e
+vm=$1
+native=$2
+dir=$3
+
+# run NAME [flags] program input
+run() {
+    name=$1
+    shift
+    for engine in switch threaded jit; do
+        stats=$("$vm" -s -e $engine -o "$dir/$name.$engine.out" "$@" 2>&1 >/dev/null | head -n 1)
+        echo "workload=$name $stats"
+    done
+    cmp "$dir/$name.switch.out" "$dir/$name.threaded.out"
+    cmp "$dir/$name.switch.out" "$dir/$name.jit.out"
+}
+
+run self meta2.asm meta2.meta
+run copies meta2.asm "$dir/copies.meta"
+run copies-optimized -O -p meta2.asm "$dir/copies.meta"
+run wide-compile meta2.asm "$dir/wide.meta"
+run wide "$dir/wide.asm" "$dir/wide.in"
+run wide-optimized -O -p "$dir/wide.asm" "$dir/wide.in"
+
+stats=$("$native" -s -o "$dir/copies.native.out" "$dir/copies.meta" 2>&1 >/dev/null)
+echo "workload=copies $stats"
+cmp "$dir/copies.switch.out" "$dir/copies.native.out"
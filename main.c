@@ -67,6 +67,27 @@ OUT             Output record               Output the output buffer with a line
                                             clear it; and set the output buffer column to the 
                                             eighth column.
 
+Extensions to the order codes
+
+CHR 'class'     Character token             After skipping initial whitespace in the input 
+                                            string, test if it begins with a character of the 
+                                            class, e.g. 'a-zA-Z_'. If so, copy it to the token 
+                                            buffer; skip over it in the input; and set switch. 
+                                            If not, reset switch.
+
+TOK 'classes'   Class token                 Same as CHR, but also take the characters that 
+                                            follow and belong to the class. A second class after 
+                                            a blank, as in 'a-z a-z0-9', is used for all but 
+                                            the first character.
+
+ANY 'literals'  Literal set token           After skipping initial whitespace in the input 
+                                            string, test if it begins with one of the blank 
+                                            separated literals. If so, copy the longest one 
+                                            found to the token buffer; skip over it in the 
+                                            input; and set switch. If not, reset switch. A 
+                                            literal that ends in a letter or digit is only 
+                                            found where no letter or digit follows it.
+
 META II Pseudo Operations (following figure 6.3 of [Schorre64])
 
 Mnemonic        Purpose                     Actions
@@ -0,0 +1,133 @@
+/*runtime for the C parsers generated by meta2c.meta
+
+  The orders are the vm core's (see vmcore.h) run against one global vm,
+  so native parsers scan, generate labels and format output exactly like
+  the interpreter.*/
+#include "vmcore.h"
+#include "runtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static Meta2Vm vm;
+static Sink sink;
+
+void m2_tst(const char * str, long len) { vm_tst(&vm, str, len); }
+void m2_id(void) { vm_id(&vm); }
+void m2_num(void) { vm_num(&vm); }
+void m2_sr(void) { vm_sr(&vm); }
+
+/*each CHR/TOK call site compiles its operand once into a first and rest
+  class, each ANY site into a trie rooted at node 0*/
+const CharSet * m2_classes(const char * spec, long len, const void ** lexer) {
+    if(*lexer == NULL) {
+        CharSet * const classes = malloc(2 * sizeof(CharSet));
+        if(classes == NULL) {
+            fatal_error(error_memory, "Out of memory\n");
+        }
+        compile_classes(spec, spec + len, classes);
+        *lexer = classes;
+    }
+    return *lexer;
+}
+
+void m2_chr(const char * spec, long len, const void ** lexer) {
+    vm_chr(&vm, &m2_classes(spec, len, lexer)[0]);
+}
+
+void m2_tok(const char * spec, long len, const void ** lexer) {
+    vm_tok(&vm, m2_classes(spec, len, lexer));
+}
+
+void m2_any(const char * spec, long len, const void ** lexer) {
+    if(*lexer == NULL) {
+        Arena arena;
+        Trie trie;
+        memset(&arena, 0, sizeof(arena));
+        memset(&trie, 0, sizeof(trie));
+        compile_trie(&arena, &trie, spec, spec + len);
+        /*the arena is never freed, like the sites' operands*/
+        *lexer = trie.nodes;
+    }
+    vm_any(&vm, *lexer, 0);
+}
+
+void m2_set(void) { vm_set(&vm); }
+void m2_be(void) { vm_be(&vm); }
+void m2_cl(const char * str, long len) { vm_cl(&vm, str, len); }
+void m2_ci(void) { vm_copy_token(&vm); }
+void m2_gn1(void) { vm_write_label(&vm, vm_frame_label(&vm, 0)); }
+void m2_gn2(void) { vm_write_label(&vm, vm_frame_label(&vm, 1)); }
+void m2_lb(void) { vm_lb(&vm); }
+void m2_out(void) { vm_out(&vm); }
+int m2_switch(void) { return vm.switch_flag; }
+
+/*native code returns through the C stack, the vm stack only holds labels*/
+void m2_enter(void) { vm_push_frame(&vm, 0); }
+void m2_leave(void) { vm_pop_frame(&vm); }
+
+void m2_usage(const char * name) {
+    fprintf(stderr,
+        "usage: %s [-Ss] [-o file] input\n"
+        "input - is stdin\n"
+        "  -o file    write the output to file instead of stdout\n"
+        "  -S         read a regular file in chunks like a pipe instead of mapping it\n"
+        "  -s         print the parse time to stderr\n", name);
+    exit(2);
+}
+
+int m2_main(int argc, char ** argv, void (*start)(void)) {
+    const char * output_file = NULL;
+    const char * input = "";
+    long input_len = 0;
+    Stream stream;
+    int streaming = 0;
+    double elapsed = 0;
+    int stats = 0;
+    int opt = 0;
+    while((opt = getopt(argc, argv, "o:Ss")) != -1) {
+        switch(opt) {
+            case 'o': output_file = optarg; break;
+            case 'S': streaming = 1; break;
+            case 's': stats = 1; break;
+            default: m2_usage(argv[0]);
+        }
+    }
+    if(argc - optind != 1) {
+        m2_usage(argv[0]);
+    }
+
+    streaming = stream_open(&stream, argv[optind], streaming);
+    if(streaming) {
+        vm.stream = &stream;
+    } else {
+        input = map_file(argv[optind], &input_len);
+    }
+    sink_init(&sink, output_file == NULL ? STDOUT_FILENO : open_output(output_file));
+    select_scanners();
+    vm.sink = &sink;
+    vm.input = input;
+    vm.input_len = input_len;
+    vm.output_column = instruction_column;
+
+    elapsed = seconds_now();
+    start();
+    sink_flush(&sink);
+    elapsed = seconds_now() - elapsed;
+    if(output_file != NULL) {
+        close(sink.fd);
+    }
+    if(stats) {
+        /*native code does not count instructions*/
+        print_stats("native", 0, vm.calls, vm.input_offset + vm.input_len, elapsed);
+    }
+    vm_release(&vm);
+    if(streaming) {
+        stream_close(&stream);
+    } else {
+        unmap_file(input, input_len);
+    }
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef META2_RUNTIME_H
+#define META2_RUNTIME_H
+
+/*runtime for the C parsers generated by meta2c.meta
+
+  Each META II order becomes one call or one of the macros below, so the
+  generated C reads like the assembly. Rules become void functions that
+  bracket their body with m2_enter/m2_leave, which push and pop the frame
+  holding the GN1/GN2 labels. Literals arrive as META II quoted strings
+  and are stringized, so the quotes are stripped at compile time; a
+  literal may therefore not end in a backslash.*/
+
+#define M2_TST(quoted) m2_tst(#quoted + 1, sizeof(#quoted) - 3)
+#define M2_CL(quoted) m2_cl(#quoted + 1, sizeof(#quoted) - 3)
+#define M2_CHR(quoted) { static const void * lexer = 0; m2_chr(#quoted + 1, sizeof(#quoted) - 3, &lexer); }
+#define M2_TOK(quoted) { static const void * lexer = 0; m2_tok(#quoted + 1, sizeof(#quoted) - 3, &lexer); }
+#define M2_ANY(quoted) { static const void * lexer = 0; m2_any(#quoted + 1, sizeof(#quoted) - 3, &lexer); }
+#define M2_CLL(rule) { void r_##rule(void); r_##rule(); }
+#define M2_BT(label) if(m2_switch()) goto label
+#define M2_BF(label) if(!m2_switch()) goto label
+
+/*a rule that never backtracks leaves its exit labels unused*/
+#if defined(__GNUC__) || defined(__clang__)
+#define M2_LABEL(label) label: __attribute__((unused));
+#else
+#define M2_LABEL(label) label: ;
+#endif
+
+#define M2_RULE(rule) void r_##rule(void) { m2_enter();
+#define M2_R() m2_leave(); }
+#define M2_MAIN(rule) \
+    void r_##rule(void); \
+    int main(int argc, char ** argv) { return m2_main(argc, argv, r_##rule); }
+
+void m2_tst(const char * str, long len);
+void m2_id(void);
+void m2_num(void);
+void m2_sr(void);
+void m2_chr(const char * spec, long len, const void ** lexer);
+void m2_tok(const char * spec, long len, const void ** lexer);
+void m2_any(const char * spec, long len, const void ** lexer);
+void m2_set(void);
+void m2_be(void);
+void m2_cl(const char * str, long len);
+void m2_ci(void);
+void m2_gn1(void);
+void m2_gn2(void);
+void m2_lb(void);
+void m2_out(void);
+int m2_switch(void);
+void m2_enter(void);
+void m2_leave(void);
+
+/*parses the input named on the command line with the start rule*/
+int m2_main(int argc, char ** argv, void (*start)(void));
+
+#endif
@@ -0,0 +1,244 @@
+/*libmetac, see metac.h
+
+  The library is vm.c without its command line: a MetacProgram wraps a
+  Program, a MetacContext a Meta2Vm, and every entry point installs an
+  ErrorHandler so fatal_error comes back here as a return code.*/
+#define VM_RUNTIME
+#include "vm.c"
+#include "metac.h"
+
+typedef char error_codes_check[
+    METAC_EPROGRAM == -error_program && METAC_ESYNTAX == -error_syntax && METAC_ENOMEM == -error_memory
+    && METAC_EIO == -error_io && METAC_EOUTPUT == -error_output ? 1 : -1];
+
+/*only the metac_ functions are exported from the shared library*/
+#if defined(__GNUC__) || defined(__clang__)
+#define metac_api __attribute__((visibility("default")))
+#else
+#define metac_api
+#endif
+
+struct MetacProgram {
+    Program program;
+};
+
+struct MetacContext {
+    Meta2Vm vm;
+    Memo memo;
+    Reparse reparse;
+    int flags;
+    char message[error_message_cap];
+};
+
+pthread_once_t scanners_once = PTHREAD_ONCE_INIT;
+
+void copy_message(char * message, long message_cap, const char * text) {
+    if(message != NULL && message_cap > 0) {
+        snprintf(message, message_cap, "%s", text);
+    }
+}
+
+metac_api
+int metac_load(const char * text, long len, int flags, MetacProgram ** out, char * message, long message_cap) {
+    ErrorHandler handler;
+    ErrorHandler * const outer = error_handler;
+    MetacProgram * const program = calloc(1, sizeof(MetacProgram));
+    OptimizeStats optimized;
+    PredictStats predicted;
+    *out = NULL;
+    if(program == NULL) {
+        copy_message(message, message_cap, "Out of memory\n");
+        return METAC_ENOMEM;
+    }
+    pthread_once(&scanners_once, select_scanners);
+
+    error_handler = &handler;
+    if(setjmp(handler.jump) != 0) {
+        error_handler = outer;
+        /*an image belongs to the caller*/
+        program->program.image = NULL;
+        free_program(&program->program);
+        free(program);
+        copy_message(message, message_cap, handler.message);
+        return -handler.code;
+    }
+    if(is_image(text, len)) {
+        load_image(text, len, "<memory>", &program->program);
+        program->program.image = NULL;
+    } else {
+        assemble_program(text, len, &program->program);
+    }
+    if(flags & METAC_OPTIMIZE) {
+        optimize_program(&program->program, &optimized);
+    }
+    if(flags & METAC_PREDICT) {
+        predict_program(&program->program, &predicted);
+    }
+    /*a program that fails only loses the fast engines*/
+    verify_program(&program->program);
+    error_handler = outer;
+    *out = program;
+    return METAC_OK;
+}
+
+metac_api
+int metac_load_file(const char * filename, int flags, MetacProgram ** out, char * message, long message_cap) {
+    ErrorHandler handler;
+    ErrorHandler * const outer = error_handler;
+    const char * text = NULL;
+    long len = 0;
+    int status = METAC_OK;
+    *out = NULL;
+
+    error_handler = &handler;
+    if(setjmp(handler.jump) != 0) {
+        error_handler = outer;
+        copy_message(message, message_cap, handler.message);
+        return -handler.code;
+    }
+    text = map_file(filename, &len);
+    error_handler = outer;
+
+    status = metac_load(text, len, flags, out, message, message_cap);
+    if(status == METAC_OK && is_image(text, len)) {
+        /*the program now reads the mapping in place*/
+        (*out)->program.image = text;
+        (*out)->program.image_len = len;
+    } else {
+        unmap_file(text, len);
+    }
+    return status;
+}
+
+metac_api
+void metac_program_free(MetacProgram * program) {
+    if(program != NULL) {
+        free_program(&program->program);
+        free(program);
+    }
+}
+
+metac_api
+int metac_context_new(const MetacProgram * program, int flags, MetacContext ** out) {
+    MetacContext * const context = calloc(1, sizeof(MetacContext));
+    *out = context;
+    if(context == NULL) {
+        return METAC_ENOMEM;
+    }
+    context->vm.program = &program->program;
+    context->flags = flags;
+    reparse_init(&context->reparse, &program->program);
+    if(flags & METAC_MEMO) {
+        context->vm.memo = &context->memo;
+    }
+    return METAC_OK;
+}
+
+metac_api
+void metac_context_free(MetacContext * context) {
+    if(context != NULL) {
+        free_vm(&context->vm);
+        memo_free(&context->memo);
+        reparse_free(&context->reparse);
+        free(context);
+    }
+}
+
+int discard_output(void * user, int column, const char * record, long len) {
+    (void)user;
+    (void)column;
+    (void)record;
+    (void)len;
+    return 0;
+}
+
+metac_api
+int metac_parse(MetacContext * context, const char * input, long len, MetacOutput output, void * user) {
+    Meta2Vm * const vm = &context->vm;
+    ErrorHandler handler;
+    ErrorHandler * const outer = error_handler;
+    vm->output = output != NULL ? output : discard_output;
+    vm->output_user = user;
+    vm->reparse = NULL;
+    context->message[0] = 0;
+
+    /*the vm and memo keep what was allocated, so an error leaks nothing
+      and the next parse starts over*/
+    error_handler = &handler;
+    if(setjmp(handler.jump) != 0) {
+        error_handler = outer;
+        copy_message(context->message, sizeof(context->message), handler.message);
+        return -handler.code;
+    }
+    if(vm->memo != NULL) {
+        /*entries are keyed by input offset*/
+        memo_free(&context->memo);
+        memo_init(&context->memo, vm->program);
+    }
+    if(context->flags & METAC_SWITCH) {
+        run_vm(vm, input, len);
+    } else if(context->flags & METAC_JIT) {
+        run_vm_jit(vm, input, len);
+    } else {
+        run_vm_threaded(vm, input, len);
+    }
+    error_handler = outer;
+
+    if(!vm->switch_flag) {
+        copy_message(context->message, sizeof(context->message), "The input does not match the start rule\n");
+        return METAC_ESYNTAX;
+    }
+    return METAC_OK;
+}
+
+metac_api
+int metac_reparse(MetacContext * context, const char * input, long len, long start, long removed, long inserted) {
+    Meta2Vm * const vm = &context->vm;
+    Memo * const memo = vm->memo;
+    ErrorHandler handler;
+    ErrorHandler * const outer = error_handler;
+    const int whole = start < 0 || removed < 0 || inserted < 0 || start + inserted > len;
+    context->message[0] = 0;
+
+    vm->memo = NULL;
+    error_handler = &handler;
+    if(setjmp(handler.jump) != 0) {
+        error_handler = outer;
+        /*reparse_edit left it invalid*/
+        vm->reparse = NULL;
+        vm->output = NULL;
+        vm->memo = memo;
+        copy_message(context->message, sizeof(context->message), handler.message);
+        return -handler.code;
+    }
+    if(whole) {
+        context->reparse.valid = 0;
+        reparse_edit(vm, &context->reparse, input, len, 0, 0, len);
+    } else {
+        reparse_edit(vm, &context->reparse, input, len, start, removed, inserted);
+    }
+    error_handler = outer;
+    vm->memo = memo;
+
+    if(!vm->switch_flag) {
+        copy_message(context->message, sizeof(context->message), "The input does not match the start rule\n");
+        return METAC_ESYNTAX;
+    }
+    return METAC_OK;
+}
+
+metac_api
+const char * metac_output(const MetacContext * context, long * len) {
+    *len = context->reparse.output.len;
+    return context->reparse.output.data;
+}
+
+metac_api
+const char * metac_message(const MetacContext * context) {
+    return context->message;
+}
+
+metac_api
+long metac_instructions(const MetacContext * context) {
+    return context->vm.instructions;
+}
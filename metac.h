@@ -0,0 +1,72 @@
+#ifndef METAC_H
+#define METAC_H
+
+/*libmetac: the META II vm as a library
+
+  A MetacProgram is loaded once and is read-only afterwards, so any number
+  of threads may parse with it at the same time. Each parse runs in a
+  MetacContext, which holds the vm stack, token and output record and is
+  used by one thread at a time; it can be reused for any number of parses.
+
+  Input is a pointer and a length, it need not be NUL terminated. Every
+  record OUT emits goes to the output callback as a span into the
+  context's record buffer, valid only during the call: column is the
+  indentation the vm would print (0 after .LABEL, 7 otherwise) and the
+  span has no line terminator. A nonzero return stops the parse.
+
+  Functions return METAC_OK or a negative error code and never exit or
+  print; metac_message() describes the last error of a context.*/
+
+#define METAC_OK 0
+#define METAC_EPROGRAM -1 /*invalid program text or image*/
+#define METAC_ESYNTAX -2  /*the input is rejected*/
+#define METAC_ENOMEM -3
+#define METAC_EIO -4
+#define METAC_EOUTPUT -5  /*the output callback returned nonzero*/
+
+/*flags for metac_load*/
+#define METAC_OPTIMIZE 1  /*inline small rules, run the peephole optimizer*/
+#define METAC_PREDICT 2   /*predict alternatives and calls from FIRST sets*/
+
+/*flags for metac_context_new; the default engine is the threaded one.
+  A program whose control flow fails the load-time verifier, which
+  hand-written assembly can, always runs on the checked switch engine.*/
+#define METAC_SWITCH 4
+#define METAC_JIT 8       /*x86-64 Linux, elsewhere the threaded engine*/
+#define METAC_MEMO 16     /*memoize rule calls (packrat mode)*/
+
+typedef struct MetacProgram MetacProgram;
+typedef struct MetacContext MetacContext;
+
+typedef int (*MetacOutput)(void * user, int column, const char * record, long len);
+
+/*loads META II assembly text or a bytecode image. Assembly is copied, an
+  image is used in place and must outlive the program. On failure message,
+  if not NULL, receives up to message_cap bytes of explanation.*/
+int metac_load(const char * text, long len, int flags, MetacProgram ** out, char * message, long message_cap);
+int metac_load_file(const char * filename, int flags, MetacProgram ** out, char * message, long message_cap);
+void metac_program_free(MetacProgram * program);
+
+int metac_context_new(const MetacProgram * program, int flags, MetacContext ** out);
+void metac_context_free(MetacContext * context);
+
+/*parses input with the start rule of the context's program; a start rule
+  that fails counts as METAC_ESYNTAX*/
+int metac_parse(MetacContext * context, const char * input, long len, MetacOutput output, void * user);
+
+/*incremental parsing for inputs that change a little at a time, such as
+  a file being edited: the first call parses all of input, later calls
+  pass the new input and the edit that turned the last input into it,
+  removed bytes at start replaced by inserted ones. Only the statements
+  around the edit run again and the rest of the last output is reused,
+  so nothing goes to a callback; metac_output() returns the whole output.
+  After an error, or an edit that does not fit the input, the next call
+  parses everything. Runs the switch engine without the memo.*/
+int metac_reparse(MetacContext * context, const char * input, long len, long start, long removed, long inserted);
+const char * metac_output(const MetacContext * context, long * len);
+
+const char * metac_message(const MetacContext * context);
+/*instructions executed by the last parse*/
+long metac_instructions(const MetacContext * context);
+
+#endif
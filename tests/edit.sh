@@ -0,0 +1,27 @@
+#!/bin/sh
+# prints FILE after EDITS pseudo-random edits, 1 by default; the same SEED
+# gives the same edits. Each replaces up to 5 bytes at a random place by
+# up to 5 bytes copied from the file, or by a token of the meta2 grammar.
+#
+#   edit.sh SEED FILE [EDITS]
+set -e
+
+awk -v seed="$1" -v edits="${3:-1}" 'BEGIN { srand(seed) }
+    { text = text $0 "\n" }
+    END {
+        split("x| |\n|ID|\047a\047|.,|/|$|(|)", tokens, "|")
+        for(e = 0; e < edits; ++e) {
+            len = length(text)
+            at = int(rand() * len) + 1
+            removed = int(rand() * 6)
+            if(rand() < 0.3) {
+                inserted = tokens[int(rand() * 10) + 1]
+            } else {
+                inserted = ""
+                n = int(rand() * 6)
+                for(i = 0; i < n; ++i) inserted = inserted substr(text, int(rand() * len) + 1, 1)
+            }
+            text = substr(text, 1, at - 1) inserted substr(text, at + removed)
+        }
+        printf "%s", text
+    }' "$2"
@@ -0,0 +1,12 @@
+       ADR S
+S
+       TST 'a'
+       BF L
+       CL 'yes'
+       OUT
+       R
+L
+       CL 'no'
+       OUT
+       R
+       END
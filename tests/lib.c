@@ -0,0 +1,281 @@
+/*libmetac test driver, see make check-lib
+
+  usage: lib program.asm program.m2b input expected
+
+  Loads the program as assembly and as an image, parses input on every
+  engine from several threads at once, each reusing its context, and
+  reparses an edit of input; every output must equal expected. Then
+  checks the error returns for a bad program, a damaged image, a missing
+  file, an input the grammar rejects and an output callback that stops.*/
+#include "metac.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define threads_per_engine 2
+#define parses_per_thread 2
+
+typedef struct {
+    char * text;
+    long len;
+    long cap;
+} Buffer;
+
+typedef struct {
+    const MetacProgram * program;
+    int flags;
+    const char * input;
+    long input_len;
+    const char * expected;
+    long expected_len;
+    int failures;
+} Job;
+
+static const int engines[] = { 0, METAC_SWITCH, METAC_JIT, METAC_MEMO, METAC_SWITCH | METAC_MEMO };
+#define engines_len (long)(sizeof(engines) / sizeof(engines[0]))
+
+static int failures = 0;
+
+/*messages end in a newline, an empty one does not*/
+static void report(const char * what, int flags, int status, const char * message) {
+    if(message == NULL || message[0] == 0) {
+        message = "\n";
+    }
+    fprintf(stderr, "FAIL %s flags=%d: status=%d %s", what, flags, status, message);
+}
+
+static void fail(const char * what, int status, const char * message) {
+    report(what, 0, status, message);
+    ++failures;
+}
+
+static char * read_file(const char * filename, long * len) {
+    FILE * const file = fopen(filename, "rb");
+    char * text = NULL;
+    if(file == NULL || fseek(file, 0, SEEK_END) != 0 || (*len = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0
+        || (text = malloc(*len + 1)) == NULL || fread(text, 1, *len, file) != (size_t)*len) {
+        fprintf(stderr, "Cannot read \"%s\"\n", filename);
+        exit(2);
+    }
+    fclose(file);
+    text[*len] = 0;
+    return text;
+}
+
+/*appends a record the way the vm prints it*/
+static int append(void * user, int column, const char * record, long len) {
+    Buffer * const buffer = user;
+    if(buffer->len + column + len + 1 > buffer->cap) {
+        char * text = NULL;
+        buffer->cap = 2 * (buffer->len + column + len + 1);
+        text = realloc(buffer->text, buffer->cap);
+        if(text == NULL) {
+            return 1;
+        }
+        buffer->text = text;
+    }
+    memset(buffer->text + buffer->len, ' ', column);
+    memcpy(buffer->text + buffer->len + column, record, len);
+    buffer->len += column + len;
+    buffer->text[buffer->len++] = '\n';
+    return 0;
+}
+
+static int stop(void * user, int column, const char * record, long len) {
+    (void)user;
+    (void)column;
+    (void)record;
+    (void)len;
+    return 1;
+}
+
+static int same(const char * text, long len, const char * expected, long expected_len) {
+    return len == expected_len && memcmp(text, expected, len) == 0;
+}
+
+static void * parse_worker(void * arg) {
+    Job * const job = arg;
+    MetacContext * context = NULL;
+    Buffer buffer = { NULL, 0, 0 };
+    int status = metac_context_new(job->program, job->flags, &context);
+    int i = 0;
+    if(status != METAC_OK) {
+        ++job->failures;
+        return NULL;
+    }
+    for(i = 0; i < parses_per_thread; ++i) {
+        buffer.len = 0;
+        status = metac_parse(context, job->input, job->input_len, append, &buffer);
+        if(status != METAC_OK || !same(buffer.text, buffer.len, job->expected, job->expected_len)) {
+            report("parse", job->flags, status, metac_message(context));
+            ++job->failures;
+        }
+    }
+    metac_context_free(context);
+    free(buffer.text);
+    return NULL;
+}
+
+/*every engine on threads_per_engine threads at once, one program*/
+static void check_threads(const MetacProgram * program, const char * input, long input_len, const char * expected, long expected_len) {
+    pthread_t threads[engines_len * threads_per_engine];
+    Job jobs[engines_len * threads_per_engine];
+    long i = 0;
+    for(i = 0; i < engines_len * threads_per_engine; ++i) {
+        jobs[i].program = program;
+        jobs[i].flags = engines[i % engines_len];
+        jobs[i].input = input;
+        jobs[i].input_len = input_len;
+        jobs[i].expected = expected;
+        jobs[i].expected_len = expected_len;
+        jobs[i].failures = 0;
+        if(pthread_create(&threads[i], NULL, parse_worker, &jobs[i]) != 0) {
+            fprintf(stderr, "Cannot create a thread\n");
+            exit(2);
+        }
+    }
+    for(i = 0; i < engines_len * threads_per_engine; ++i) {
+        pthread_join(threads[i], NULL);
+        failures += jobs[i].failures;
+    }
+}
+
+/*parses input, a copy with a newline added after the one nearest its
+  middle, then input again; the edit changes no token, so every output
+  is expected*/
+static void check_reparse(const MetacProgram * program, const char * input, long input_len, const char * expected, long expected_len) {
+    MetacContext * context = NULL;
+    char * const edited = malloc(input_len + 1);
+    const char * output = NULL;
+    long output_len = 0;
+    long at = input_len / 2;
+    int status = 0;
+    if(edited == NULL || metac_context_new(program, 0, &context) != METAC_OK) {
+        fail("reparse setup", METAC_ENOMEM, NULL);
+        free(edited);
+        return;
+    }
+    while(at < input_len && input[at] != '\n') {
+        ++at;
+    }
+    at = at < input_len ? at + 1 : input_len;
+    memcpy(edited, input, at);
+    edited[at] = '\n';
+    memcpy(edited + at + 1, input + at, input_len - at);
+
+    status = metac_reparse(context, input, input_len, 0, 0, input_len);
+    output = metac_output(context, &output_len);
+    if(status != METAC_OK || !same(output, output_len, expected, expected_len)) {
+        fail("reparse full", status, metac_message(context));
+    }
+    status = metac_reparse(context, edited, input_len + 1, at, 0, 1);
+    output = metac_output(context, &output_len);
+    if(status != METAC_OK || !same(output, output_len, expected, expected_len)) {
+        fail("reparse insert", status, metac_message(context));
+    }
+    status = metac_reparse(context, input, input_len, at, 1, 0);
+    output = metac_output(context, &output_len);
+    if(status != METAC_OK || !same(output, output_len, expected, expected_len)) {
+        fail("reparse remove", status, metac_message(context));
+    }
+    metac_context_free(context);
+    free(edited);
+}
+
+static void check_load_error(const char * what, const char * text, long len, int expected) {
+    MetacProgram * program = NULL;
+    char message[256];
+    int status = 0;
+    message[0] = 0;
+    status = metac_load(text, len, 0, &program, message, sizeof(message));
+    if(status != expected || program != NULL || message[0] == 0) {
+        fail(what, status, message);
+    }
+    metac_program_free(program);
+}
+
+/*a rejected input and a callback that stops, then the context is reused*/
+static void check_parse_errors(const MetacProgram * program, const char * input, long input_len, const char * expected, long expected_len) {
+    MetacContext * context = NULL;
+    Buffer buffer = { NULL, 0, 0 };
+    int status = metac_context_new(program, 0, &context);
+    if(status != METAC_OK) {
+        fail("context", status, NULL);
+        return;
+    }
+    status = metac_parse(context, "$", 1, append, &buffer);
+    if(status != METAC_ESYNTAX || metac_message(context)[0] == 0) {
+        fail("syntax error", status, metac_message(context));
+    }
+    status = metac_parse(context, input, input_len, stop, NULL);
+    if(status != METAC_EOUTPUT) {
+        fail("output stop", status, metac_message(context));
+    }
+    buffer.len = 0;
+    status = metac_parse(context, input, input_len, append, &buffer);
+    if(status != METAC_OK || !same(buffer.text, buffer.len, expected, expected_len)) {
+        fail("parse after errors", status, metac_message(context));
+    }
+    metac_context_free(context);
+    free(buffer.text);
+}
+
+int main(int argc, char ** argv) {
+    MetacProgram * program = NULL;
+    MetacProgram * image = NULL;
+    char message[256];
+    long input_len = 0;
+    long expected_len = 0;
+    long image_len = 0;
+    char * input = NULL;
+    char * expected = NULL;
+    char * image_text = NULL;
+    int status = 0;
+    if(argc != 5) {
+        fprintf(stderr, "usage: lib program.asm program.m2b input expected\n");
+        return 2;
+    }
+    input = read_file(argv[3], &input_len);
+    expected = read_file(argv[4], &expected_len);
+
+    status = metac_load_file(argv[1], 0, &program, message, sizeof(message));
+    if(status != METAC_OK) {
+        fail("load assembly", status, message);
+        return 1;
+    }
+    check_threads(program, input, input_len, expected, expected_len);
+    check_reparse(program, input, input_len, expected, expected_len);
+    check_parse_errors(program, input, input_len, expected, expected_len);
+    metac_program_free(program);
+
+    status = metac_load_file(argv[2], METAC_OPTIMIZE | METAC_PREDICT, &image, message, sizeof(message));
+    if(status != METAC_OK) {
+        fail("load image", status, message);
+        return 1;
+    }
+    check_threads(image, input, input_len, expected, expected_len);
+    metac_program_free(image);
+
+    /*an image cut short, then one with a wrong version*/
+    image_text = read_file(argv[2], &image_len);
+    check_load_error("truncated image", image_text, image_len / 2, METAC_EPROGRAM);
+    check_load_error("header only image", image_text, 8, METAC_EPROGRAM);
+    image_text[4] ^= 0x7f;
+    check_load_error("image version", image_text, image_len, METAC_EPROGRAM);
+    check_load_error("bad assembly", "junk\n", 5, METAC_EPROGRAM);
+    check_load_error("undefined label", " ADR X\nX\n CLL Y\n R\n END\n", 24, METAC_EPROGRAM);
+    status = metac_load_file("/nonexistent/program.asm", 0, &program, message, sizeof(message));
+    if(status != METAC_EIO || program != NULL) {
+        fail("missing file", status, message);
+    }
+
+    free(image_text);
+    free(expected);
+    free(input);
+    if(failures > 0) {
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# reparse fuzz for make check-reparse: COUNT random edits of INPUT, each
+# reparsed with -R from INPUT, with and without -O -p, must give the
+# output and exit status of a full parse. Inputs that do not are kept
+# in DIR as bad-SEED.
+#
+#   reparse.sh VM PROGRAM INPUT COUNT DIR
+set -e
+here=$(dirname "$0")
+vm=$1
+program=$2
+input=$3
+count=$4
+dir=$5
+mkdir -p "$dir"
+
+bad=0
+seed=0
+while [ $seed -lt "$count" ]; do
+    "$here/edit.sh" $seed "$input" > "$dir/new"
+    status=0
+    "$vm" -e switch -o "$dir/full" "$program" "$dir/new" 2>/dev/null || status=$?
+    for flags in "" "-O -p"; do
+        reparse_status=0
+        "$vm" $flags -o "$dir/reparse" -R "$input" "$program" "$dir/new" 2>/dev/null || reparse_status=$?
+        if [ $reparse_status -ne $status ] || ! cmp -s "$dir/full" "$dir/reparse"; then
+            echo "MISMATCH seed=$seed flags=$flags status=$reparse_status expected=$status"
+            cp "$dir/new" "$dir/bad-$seed"
+            bad=$((bad + 1))
+        fi
+    done
+    seed=$((seed + 1))
+done
+echo "edits=$count mismatches=$bad"
+[ $bad -eq 0 ]
@@ -0,0 +1,108 @@
+/*scanner test driver, see make check-scan
+
+  Every SIMD scanner the cpu runs must stop where the scalar one does,
+  for every class, start alignment and end, on bytes drawn to make long
+  runs of each class as well as every byte value.*/
+#include "vmcore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define buffer_len 512
+#define rounds 50
+
+typedef struct {
+    const char * name;
+    ScanFn scan;
+    ScanFn scalar;
+} Case;
+
+static int failures = 0;
+
+/*runs of one class broken by a byte of another, or anything*/
+static void fill(char * buffer, long len, unsigned * seed) {
+    static const char * const pools[] = { " \t\n\r\v\f", "abcxyzABCXYZ0189_", "0123456789" };
+    long i = 0;
+    while(i < len) {
+        const char * const pool = pools[rand_r(seed) % 3];
+        const long run = rand_r(seed) % 70;
+        long j = 0;
+        for(j = 0; j < run && i < len; ++j) {
+            buffer[i++] = pool[rand_r(seed) % strlen(pool)];
+        }
+        if(i < len) {
+            buffer[i++] = (char)(rand_r(seed) % 256);
+        }
+    }
+}
+
+static void check(const Case * test, const char * buffer) {
+    long from = 0;
+    for(from = 0; from < 32; ++from) {
+        long to = 0;
+        for(to = from; to <= buffer_len; ++to) {
+            const char * const want = test->scalar(buffer + from, buffer + to);
+            const char * const got = test->scan(buffer + from, buffer + to);
+            if(got != want) {
+                fprintf(stderr, "FAIL %s [%ld, %ld): stopped at %ld, expected %ld\n",
+                    test->name, from, to, (long)(got - buffer), (long)(want - buffer));
+                ++failures;
+                return;
+            }
+        }
+    }
+}
+
+int main(void) {
+    Case cases[6];
+    long cases_len = 0;
+    char * const buffer = malloc(buffer_len);
+    unsigned seed = 1;
+    long round = 0;
+    long i = 0;
+    if(buffer == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 2;
+    }
+#ifdef HAVE_SIMD_SCANNERS
+    {
+        static const Case sse2[] = {
+            { "space/sse2", scan_space_sse2, scan_space_scalar },
+            { "alnum/sse2", scan_alnum_sse2, scan_alnum_scalar },
+            { "digit/sse2", scan_digit_sse2, scan_digit_scalar },
+        };
+        static const Case avx2[] = {
+            { "space/avx2", scan_space_avx2, scan_space_scalar },
+            { "alnum/avx2", scan_alnum_avx2, scan_alnum_scalar },
+            { "digit/avx2", scan_digit_avx2, scan_digit_scalar },
+        };
+        memcpy(cases, sse2, sizeof(sse2));
+        cases_len = 3;
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2")) {
+            memcpy(cases + cases_len, avx2, sizeof(avx2));
+            cases_len += 3;
+        }
+    }
+#endif
+    /*the class table against the "C" locale's definitions*/
+    for(i = 0; i < 256; ++i) {
+        const int space = i == ' ' || (i >= '\t' && i <= '\r');
+        const int alpha = (i >= 'a' && i <= 'z') || (i >= 'A' && i <= 'Z');
+        const int digit = i >= '0' && i <= '9';
+        if(!char_is(i, class_space) != !space || !char_is(i, class_alpha) != !alpha || !char_is(i, class_digit) != !digit) {
+            fprintf(stderr, "FAIL class of byte %ld\n", i);
+            ++failures;
+        }
+    }
+    for(round = 0; round < rounds; ++round) {
+        fill(buffer, buffer_len, &seed);
+        for(i = 0; i < cases_len; ++i) {
+            check(&cases[i], buffer);
+        }
+    }
+    select_scanners();
+    printf("scanners=%s cases=%ld rounds=%d failures=%d\n", scanners.name, cases_len, rounds, failures);
+    free(buffer);
+    return failures > 0;
+}
@@ -0,0 +1,52 @@
+#!/bin/sh
+# -j checks for make check-split. LARGE is parsed with -j 2 to 31 by VM
+# and must give the serial output. Then COUNT copies of INPUT with 0 to 2
+# random edits go through SMALL_VM, a vm built with a tiny SPLIT_MIN so
+# that they split too, with a -j picked by the seed; output, exit status
+# and the error message must match a serial parse. Inputs that do not
+# are kept in DIR as bad-SEED.
+#
+#   split.sh VM SMALL_VM PROGRAM LARGE INPUT COUNT DIR
+set -e
+here=$(dirname "$0")
+vm=$1
+small_vm=$2
+program=$3
+large=$4
+input=$5
+count=$6
+dir=$7
+mkdir -p "$dir"
+
+bad=0
+"$vm" -e switch -o "$dir/serial" "$program" "$large"
+for jobs in 2 3 4 8 16 31; do
+    "$vm" -j $jobs -o "$dir/split" "$program" "$large"
+    if ! cmp -s "$dir/serial" "$dir/split"; then
+        echo "MISMATCH $large -j $jobs"
+        bad=$((bad + 1))
+    fi
+done
+
+joined=0
+seed=0
+while [ $seed -lt "$count" ]; do
+    "$here/edit.sh" $seed "$input" $((seed % 3)) > "$dir/new"
+    jobs=$(echo "2 3 4 7 13 40" | cut -d' ' -f$((seed % 6 + 1)))
+    status=0
+    "$small_vm" -e switch -o "$dir/serial" "$program" "$dir/new" 2> "$dir/serial.err" || status=$?
+    split_status=0
+    "$small_vm" -s -j $jobs -o "$dir/split" "$program" "$dir/new" 2> "$dir/split.err" || split_status=$?
+    if grep -q "joined=1" "$dir/split.err"; then
+        joined=$((joined + 1))
+    fi
+    if [ $split_status -ne $status ] || ! cmp -s "$dir/serial" "$dir/split" \
+        || [ "$(grep '^Error' "$dir/serial.err")" != "$(grep '^Error' "$dir/split.err")" ]; then
+        echo "MISMATCH seed=$seed -j $jobs status=$split_status expected=$status"
+        cp "$dir/new" "$dir/bad-$seed"
+        bad=$((bad + 1))
+    fi
+    seed=$((seed + 1))
+done
+echo "inputs=$count joined=$joined mismatches=$bad"
+[ $bad -eq 0 ]
@@ -1,24 +1,28 @@
+#define _DEFAULT_SOURCE
+
 #include <stdarg.h>
 #include <signal.h>
 #include <stdio.h>
 #include <assert.h>
-#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
-
-#define str_cap 16
-#define vm_cap 256
-
-void gensym(char * out, int len) {
-    static int counter = 0;
-    assert(out != NULL);
-    snprintf(out, len, "A%d", counter);
-    if(counter == INT_MAX) {
-        counter = 0;
-    }
-    ++counter;
-}
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <setjmp.h>
+
+/*the primitives shared with the native runtime, built in so that the
+  engines can inline them*/
+#include "vmcore.c"
+
+#define halt_address -1
 
 const char * opcode_names[] = {
         "opcode_tst",
@@ -38,6 +42,15 @@ const char * opcode_names[] = {
         "opcode_gn2",
         "opcode_lb",
         "opcode_out",
+        "opcode_chr",
+        "opcode_tok",
+        "opcode_any",
+        "opcode_tst_bf",
+        "opcode_tst_be",
+        "opcode_cll_bt",
+        "opcode_cll_bf",
+        "opcode_cl_out",
+        "opcode_dispatch",
 };
 
 typedef struct {
@@ -59,475 +72,3788 @@ typedef struct {
         opcode_gn2,
         opcode_lb,
         opcode_out,
+        /*lexical tests, operands compiled by compile_lexers*/
+        opcode_chr,
+        opcode_tok,
+        opcode_any,
+        /*superinstructions, only made by optimize_program*/
+        opcode_tst_bf,
+        opcode_tst_be,
+        opcode_cll_bt,
+        opcode_cll_bf,
+        opcode_cl_out,
+        /*made by predict_program, never stored in images*/
+        opcode_dispatch,
     } id;
-    char str[str_cap];
+    /*CLL/B/BT/BF: instruction index of the label (resolved by link_vm)
+      TST/CL/CHR/TOK/ANY: offset of the operand in the string pool
+      DISPATCH: offset of its table in Program.jump_tables
+      otherwise: unused*/
+    int arg;
+    /*branch target of TST_BF/CLL_BT/CLL_BF*/
+    int arg2;
 } Opcode;
 
 typedef struct {
     int isp;
-    char str[str_cap];
+    int name; /*offset in the string pool*/
 } Label;
 
+/*compiled operand of CHR/TOK/ANY*/
 typedef struct {
-    char label1[str_cap];  
-    char label2[str_cap];  
-    int return_address;
-} StackCell;
+    int classes; /*first and rest class in Program.classes*/
+    int trie;    /*root in Program.trie*/
+} Lexer;
+
+/*a loaded program, read-only while it runs. It is either assembled into
+  its arena or points straight into a mapped bytecode image.*/
+typedef struct Program {
+    const Opcode * code;
+    long code_len;
+    const Label * labels;
+    long labels_len;
+    const char * strings; /*interned operands and label names, NUL separated*/
+    long strings_len;
+    int start;
+
+    /*filled by compile_lexers when the program uses CHR/TOK/ANY*/
+    const int * lexers; /*per string pool offset, index in lexer_table or -1*/
+    const Lexer * lexer_table;
+    const CharSet * classes;
+    const TrieNode * trie;
+
+    /*filled by predict_program, NULL otherwise*/
+    const int * rule_first; /*per isp: FIRST set of the rule starting there, -1 if unknown*/
+    const CharSet * first_sets;
+    const int * jump_tables; /*256 targets per DISPATCH*/
+
+    int verified; /*set by verify_program*/
+    const long * literal_lens; /*per isp: length of the string operand, by verify_program*/
+
+    Arena arena;
+    const char * image;
+    long image_len;
+} Program;
+
+/*tracing
+
+  TRACE_LEVEL is the highest level compiled in; with -DTRACE_LEVEL=0 every
+  trace_enabled() check folds to 0 and the tracing code disappears. At run
+  time "-t level" picks how much of that is switched on:
+    1  record every executed instruction in a ring buffer, which is dumped
+       on fatal_error or at exit with -d
+    2  also print each event and the loader's progress to stderr*/
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 2
+#endif
+
+#if TRACE_LEVEL > 0
+#define trace_enabled(level) (trace_level >= (level) && (level) <= TRACE_LEVEL)
+#else
+#define trace_enabled(level) 0
+#endif
+
+#define trace_ring_cap 256
 
 typedef struct {
-    Opcode opcodes[vm_cap];
-    long opcode_len;
-    Label labels[vm_cap];
-    long labels_len;
-    StackCell stack[vm_cap];
-    long stack_len;
-    char token[str_cap];
-    long token_len;
+    int isp;
+    int opcode;
+    long input_i;
     int switch_flag;
+} TraceEvent;
+
+int trace_level = 0;
+TraceEvent trace_ring[trace_ring_cap];
+long trace_events = 0;
+
+void trace_record(int isp, int opcode, long input_i, int switch_flag) {
+    TraceEvent * event = &trace_ring[trace_events % trace_ring_cap];
+    event->isp = isp;
+    event->opcode = opcode;
+    event->input_i = input_i;
+    event->switch_flag = switch_flag;
+    ++trace_events;
+    if(trace_enabled(2)) {
+        fprintf(stderr, "trace: isp=%d %s input_i=%ld switch=%d\n", isp, opcode_names[opcode], input_i, switch_flag);
+    }
+}
 
-    char starting_label[str_cap];
-    int isp;
+/*print the buffered events, oldest first*/
+void trace_dump(void) {
+    long i = trace_events > trace_ring_cap ? trace_events - trace_ring_cap : 0;
+    if(trace_events == 0) {
+        return;
+    }
+    fprintf(stderr, "last %ld of %ld traced instructions:\n", trace_events - i, trace_events);
+    for(; i < trace_events; ++i) {
+        const TraceEvent event = trace_ring[i % trace_ring_cap];
+        fprintf(stderr, "  isp=%-6d %-12s input_i=%-8ld switch=%d\n",
+            event.isp, opcode_names[event.opcode], event.input_i, event.switch_flag);
+    }
+}
 
-    char * input;
-    long input_i;
-    long input_len;
+const char * skip_whitespace(const char * str, const char * end) {
+    return scan_space_scalar(str, end);
+}
 
-    char output[str_cap];
-    int output_i;
-    int output_column;
-} Meta2Vm;
+const char * skip_alpha_digit(const char * str, const char * end) {
+    return scan_alnum_scalar(str, end);
+}
 
-#if defined(__GNUC__) || defined(__clang__)
-#define NORETURN __attribute__((noreturn))
-#else
-#define NORETURN
-#endif
+#define ARRAY_LEN(arr) (long)(sizeof(arr) / sizeof(arr[0]))
 
-NORETURN
-void fatal_error(const char * const fmt, ...) {
-    printf("Error: ");
-    va_list args;
-    va_start(args, fmt);
-    vprintf(fmt, args);
-    va_end(args);
-    abort();
+int opcode_has_label(int id) {
+    return id == opcode_cll || id == opcode_b || id == opcode_bt || id == opcode_bf
+        || id == opcode_cll_bt || id == opcode_cll_bf;
 }
 
-void read_file(const char * filename, char * buf, long buflen) {
-    assert(filename != NULL);
-    assert(buf != NULL);
-    {
-        FILE * fp = fopen(filename, "r");
-        int i = 0;
-        for(;!feof(fp); ++i) {
-            assert(i < buflen && "buffer overflow");
-            buf[i] = fgetc(fp);         
-            if(i == INT_MAX) {
-                i = 0;
-            }
-        }
-        fclose(fp);
-        buf[i] = 0;
+int opcode_has_string(int id) {
+    return id == opcode_tst || id == opcode_cl
+        || id == opcode_chr || id == opcode_tok || id == opcode_any
+        || id == opcode_tst_bf || id == opcode_tst_be || id == opcode_cl_out;
+}
+
+int opcode_is_lexer(int id) {
+    return id == opcode_chr || id == opcode_tok || id == opcode_any;
+}
+
+int opcode_has_label2(int id) {
+    return id == opcode_tst_bf || id == opcode_cll_bt || id == opcode_cll_bf;
+}
+
+/*assembler state, only alive while a text program is being loaded*/
+
+typedef struct {
+    int name; /*offset in the string pool*/
+    int isp;  /*-1 until the symbol is defined as a label*/
+} Symbol;
+
+typedef struct {
+    Program * program;
+    Opcode * code;
+    long code_len;
+    long code_cap;
+    Label * labels;
+    long labels_len;
+    long labels_cap;
+    char * strings;
+    long strings_len;
+    long strings_cap;
+
+    /*interning table: symbols in order of appearance, plus an open
+      addressing index of symbol numbers (-1 for empty slots). They live
+      in the program's arena, so a failed load frees them with it.*/
+    Symbol * symbols;
+    long symbols_len;
+    long symbols_cap;
+    int * slots;
+    long slots_cap;
+
+    int start_symbol;
+} Assembler;
+
+unsigned long hash_bytes(const char * bytes, long len) {
+    /*FNV-1a*/
+    unsigned long hash = 2166136261UL;
+    long i = 0;
+    for(i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char)bytes[i]) * 16777619UL;
     }
+    return hash;
 }
 
-char * skip_whitespace(char * str) {
-    for(;isspace(*str); ++str);
-    return str;
+void assembler_rehash(Assembler * self) {
+    const long slots_cap = self->slots_cap > 0 ? self->slots_cap * 2 : 256;
+    long i = 0;
+    self->slots = arena_alloc(&self->program->arena, slots_cap * sizeof(int));
+    self->slots_cap = slots_cap;
+    for(i = 0; i < slots_cap; ++i) {
+        self->slots[i] = -1;
+    }
+    for(i = 0; i < self->symbols_len; ++i) {
+        const char * name = &self->strings[self->symbols[i].name];
+        unsigned long slot = hash_bytes(name, strlen(name)) & (slots_cap - 1);
+        while(self->slots[slot] != -1) {
+            slot = (slot + 1) & (slots_cap - 1);
+        }
+        self->slots[slot] = i;
+    }
 }
 
-char * skip_alpha_digit(char * str) {
-    for(;isalpha(*str) || isdigit(*str); ++str);
-    return str;
+/*returns the symbol number of str, adding it to the string pool if it is new*/
+int assembler_intern(Assembler * self, const char * str, long len) {
+    unsigned long slot = 0;
+    assert(self);
+    assert(str);
+    assert(len >= 0);
+    if((self->symbols_len + 1) * 2 > self->slots_cap) {
+        assembler_rehash(self);
+    }
+    slot = hash_bytes(str, len) & (self->slots_cap - 1);
+    for(;self->slots[slot] != -1; slot = (slot + 1) & (self->slots_cap - 1)) {
+        const int symbol = self->slots[slot];
+        const char * candidate = &self->strings[self->symbols[symbol].name];
+        if(strncmp(candidate, str, len) == 0 && candidate[len] == 0) {
+            return symbol;
+        }
+    }
+    if(self->strings_len + len + 1 > INT_MAX || self->symbols_len >= INT_MAX) {
+        fatal_error(error_program, "String pool overflow\n");
+    }
+
+    self->strings = arena_reserve(&self->program->arena, self->strings, &self->strings_cap, self->strings_len + len + 1, 1);
+    memcpy(&self->strings[self->strings_len], str, len);
+    self->strings[self->strings_len + len] = 0;
+
+    self->symbols = arena_reserve(&self->program->arena, self->symbols, &self->symbols_cap, self->symbols_len + 1, sizeof(Symbol));
+    self->symbols[self->symbols_len].name = self->strings_len;
+    self->symbols[self->symbols_len].isp = -1;
+    self->strings_len += len + 1;
+    self->slots[slot] = self->symbols_len;
+    return self->symbols_len++;
 }
 
-#define streql(ptr, literal) strncmp(ptr, literal, strnlen(literal, str_cap)) == 0
+#define streql(ptr, len, literal) ((len) == (long)sizeof(literal) - 1 && memcmp(ptr, literal, len) == 0)
 
-int load_line(char * line, Meta2Vm * out) {
+/*parses the line [line, end), which does not include the line terminator*/
+int load_line(const char * line, const char * end, Assembler * out) {
     assert(line && "Line is NULL");
-    assert(strnlen(line, str_cap) > 0 && "empty line");
+    assert(line < end && "empty line");
     if(line[0] == ' ' || line[0] == '\t') {
         Opcode op = {0};
-        char opstr[str_cap] = {0};
+        const char * opstr = NULL;
+        long oplen = 0;
         /*opcode*/
-        line = skip_whitespace(line);
+        line = skip_whitespace(line, end);
+        opstr = line;
+        line = skip_alpha_digit(line, end);
+        oplen = line - opstr;
+        line = skip_whitespace(line, end);
 
-        memmove(opstr, line, strcspn(line, " \n"));
+        /*Remove trailing whitespace*/
+        for(;end > line && char_is(end[-1], class_space); --end);
 
-        if(streql(opstr, "ADR")) {
-            line = skip_alpha_digit(line);
-            line = skip_whitespace(line);
-            memmove(out->starting_label, line, strnlen(line, str_cap));
+        if(oplen == 0) {
+            /*blank line*/
             return 1;
         }
 
+        if(streql(opstr, oplen, "ADR")) {
+            out->start_symbol = assembler_intern(out, line, end - line);
+            return 1;
+        }
 
-        if(streql(opstr, "TST")) op.id = opcode_tst;
-        else if(streql(opstr, "ID")) op.id = opcode_id; 
-        else if(streql(opstr, "NUM")) op.id = opcode_num; 
-        else if(streql(opstr, "SR")) op.id = opcode_sr; 
-        else if(streql(opstr, "CLL")) op.id = opcode_cll; 
-        else if(streql(opstr, "R")) op.id = opcode_r; 
-        else if(streql(opstr, "SET")) op.id = opcode_set; 
-        else if(streql(opstr, "BT")) op.id = opcode_bt; 
-        else if(streql(opstr, "BF")) op.id = opcode_bf; 
-        else if(streql(opstr, "BE")) op.id = opcode_be; 
-        else if(streql(opstr, "B")) op.id = opcode_b; 
-        else if(streql(opstr, "CL")) op.id = opcode_cl; 
-        else if(streql(opstr, "CI")) op.id = opcode_ci; 
-        else if(streql(opstr, "GN1")) op.id = opcode_gn1; 
-        else if(streql(opstr, "GN2")) op.id = opcode_gn2; 
-        else if(streql(opstr, "LB")) op.id = opcode_lb; 
-        else if(streql(opstr, "OUT")) op.id = opcode_out; 
-        else if(streql(opstr, "END")) {
-            printf("END REACHED\n");
+        if(streql(opstr, oplen, "TST")) op.id = opcode_tst;
+        else if(streql(opstr, oplen, "ID")) op.id = opcode_id;
+        else if(streql(opstr, oplen, "NUM")) op.id = opcode_num;
+        else if(streql(opstr, oplen, "SR")) op.id = opcode_sr;
+        else if(streql(opstr, oplen, "CLL")) op.id = opcode_cll;
+        else if(streql(opstr, oplen, "R")) op.id = opcode_r;
+        else if(streql(opstr, oplen, "SET")) op.id = opcode_set;
+        else if(streql(opstr, oplen, "BT")) op.id = opcode_bt;
+        else if(streql(opstr, oplen, "BF")) op.id = opcode_bf;
+        else if(streql(opstr, oplen, "BE")) op.id = opcode_be;
+        else if(streql(opstr, oplen, "B")) op.id = opcode_b;
+        else if(streql(opstr, oplen, "CL")) op.id = opcode_cl;
+        else if(streql(opstr, oplen, "CI")) op.id = opcode_ci;
+        else if(streql(opstr, oplen, "GN1")) op.id = opcode_gn1;
+        else if(streql(opstr, oplen, "GN2")) op.id = opcode_gn2;
+        else if(streql(opstr, oplen, "LB")) op.id = opcode_lb;
+        else if(streql(opstr, oplen, "OUT")) op.id = opcode_out;
+        else if(streql(opstr, oplen, "CHR")) op.id = opcode_chr;
+        else if(streql(opstr, oplen, "TOK")) op.id = opcode_tok;
+        else if(streql(opstr, oplen, "ANY")) op.id = opcode_any;
+        else if(streql(opstr, oplen, "END")) {
+            if(trace_enabled(2)) {
+                fprintf(stderr, "END REACHED\n");
+            }
             return 0;
         }
-        else fatal_error("invalid opcode \"%s\"\n", opstr);
-
-        printf("Parsed \"%s\" into %s\n", opstr, opcode_names[op.id]);
+        else fatal_error(error_program, "invalid opcode \"%.*s\"\n", (int)oplen, opstr);
 
-        line = skip_alpha_digit(line);
-        line = skip_whitespace(line);
-        {
-            /*Remove trailing whitespace*/
-            const long len = strnlen(line, str_cap);
-            if(len > 0 && line[len - 1] == ' ') {
-                line[strnlen(line, str_cap) - 1] = 0;
-            }
+        if(trace_enabled(2)) {
+            fprintf(stderr, "Parsed \"%.*s\" into %s\n", (int)oplen, opstr, opcode_names[op.id]);
         }
-        {
-            /*Remove quotes around string arguments*/
-            const long len = strnlen(line, str_cap);
-            if(len > 0 && line[len - 1] == '\'') {
-                line[len - 1] = 0;
-            }
-            if(line[0] == '\'') {
-                ++line;
-            }
 
+        /*Remove quotes around string arguments*/
+        if(end - line >= 2 && line[0] == '\'' && end[-1] == '\'') {
+            ++line;
+            --end;
         }
 
-        memmove(op.str, line, strnlen(line, str_cap));
+        if(opcode_has_string(op.id)) {
+            const int symbol = assembler_intern(out, line, end - line);
+            op.arg = out->symbols[symbol].name;
+        } else if(opcode_has_label(op.id)) {
+            /*symbol number for now, link_program turns it into an instruction index*/
+            op.arg = assembler_intern(out, line, end - line);
+        }
 
-        out->opcodes[out->opcode_len] = op;
-        ++out->opcode_len;
+        if(out->code_len >= INT_MAX) {
+            fatal_error(error_program, "Program too large\n");
+        }
+        out->code = arena_reserve(&out->program->arena, out->code, &out->code_cap, out->code_len + 1, sizeof(Opcode));
+        out->code[out->code_len] = op;
+        ++out->code_len;
     } else {
-        /*printf("Found label: %s\n", line);*/
         /*label*/
-        memmove(out->labels[out->labels_len].str, line, strnlen(line, str_cap));
-        out->labels[out->labels_len].isp = out->opcode_len;
-        ++out->labels_len;
-        if(strncmp(out->starting_label, line, strnlen(line, str_cap)) == 0) {
-            printf("STARTING LABEL FOUND\n");
-            out->isp = out->opcode_len;
+        const int symbol = assembler_intern(out, line, skip_alpha_digit(line, end) - line);
+        if(out->symbols[symbol].isp != -1) {
+            fatal_error(error_program, "Duplicate label \"%s\"\n", &out->strings[out->symbols[symbol].name]);
         }
+        out->symbols[symbol].isp = out->code_len;
+        out->labels = arena_reserve(&out->program->arena, out->labels, &out->labels_cap, out->labels_len + 1, sizeof(Label));
+        out->labels[out->labels_len].name = out->symbols[symbol].name;
+        out->labels[out->labels_len].isp = out->code_len;
+        ++out->labels_len;
     }
     return 1;
 }
 
-void load_vm(char * input, Meta2Vm * out) {
-    memset(out, 0, sizeof(Meta2Vm));
-    char * line = strtok(input, "\n");
-
-    for(;line != NULL && load_line(line, out); line = strtok(NULL, "\n")) {
+/*resolve every label operand to an instruction index once, so the dispatch loop never touches strings*/
+void link_program(Assembler * self) {
+    long i = 0;
+    int undefined = 0;
+    long first_undefined = 0;
+    const char * first_name = NULL;
+    assert(self);
+    for(i = 0; i < self->code_len; ++i) {
+        Opcode * op = &self->code[i];
+        if(opcode_has_label(op->id)) {
+            const Symbol symbol = self->symbols[op->arg];
+            op->arg = symbol.isp;
+            if(op->arg < 0 && undefined++ == 0) {
+                first_undefined = i;
+                first_name = &self->strings[symbol.name];
+            }
+        }
+    }
+    if(self->start_symbol < 0) {
+        fatal_error(error_program, "Missing ADR\n");
+    }
+    self->program->start = self->symbols[self->start_symbol].isp;
+    if(self->program->start < 0) {
+        fatal_error(error_program, "Undefined starting label \"%s\"\n", &self->strings[self->symbols[self->start_symbol].name]);
+    }
+    if(undefined > 0) {
+        fatal_error(error_program, "%d undefined label reference(s), the first is \"%s\" used by instruction %ld\n",
+            undefined, first_name, first_undefined);
     }
-    out->stack_len = 1;
 }
 
-/*vm utilities*/
+/*lexical operands
 
-char * vm_input(Meta2Vm* self) {
-    assert(self);
-    assert(self->input_i >= 0);
-    assert(self->input_i <= self->input_len);
-    return &self->input[self->input_i];
+  CHR 'spec' matches one character of a class, TOK 'spec' a run of them
+  and ANY 'spec' the longest of a set of literals, words only where they
+  end; each copies what it matched into the token like ID does.
+
+  A class is written as characters and ranges, 'a-zA-Z_'; a '-' first or
+  last stands for itself. A TOK spec may hold two classes separated by a
+  blank, one for the first character and one for the rest, as in
+  'a-zA-Z_ a-zA-Z0-9_'. An ANY spec is its literals separated by blanks.
+  They are compiled once per program into class bitmaps and a trie.*/
+
+typedef struct {
+    Lexer * table;
+    long table_len;
+    long table_cap;
+    CharSet * classes;
+    long classes_len;
+    long classes_cap;
+    Trie trie;
+} LexerBuilder;
+
+void compile_lexer(Program * program, LexerBuilder * builder, int id, const char * spec) {
+    const char * const end = spec + strlen(spec);
+    Lexer * lexer = &builder->table[program->lexers[spec - program->strings]];
+    if(id == opcode_any) {
+        if(lexer->trie < 0) {
+            lexer->trie = compile_trie(&program->arena, &builder->trie, spec, end);
+        }
+    } else if(lexer->classes < 0) {
+        builder->classes = arena_reserve(&program->arena, builder->classes, &builder->classes_cap,
+            builder->classes_len + 2, sizeof(CharSet));
+        lexer->classes = builder->classes_len;
+        compile_classes(spec, end, &builder->classes[builder->classes_len]);
+        builder->classes_len += 2;
+    }
 }
 
-void vm_skip_whitespace(Meta2Vm* self) {
-    assert(self);
-    for(;isspace(self->input[self->input_i]); ++self->input_i);
-    assert(!isspace(vm_input(self)[0]) && "skip whitespace failed");
+void compile_lexers(Program * program) {
+    LexerBuilder builder;
+    int * lexers = NULL;
+    long i = 0;
+    memset(&builder, 0, sizeof(builder));
+    for(i = 0; i < program->code_len && !opcode_is_lexer(program->code[i].id); ++i);
+    if(i == program->code_len) {
+        return;
+    }
+    lexers = arena_alloc(&program->arena, program->strings_len * sizeof(int));
+    for(i = 0; i < program->strings_len; ++i) {
+        lexers[i] = -1;
+    }
+    program->lexers = lexers;
+    for(i = 0; i < program->code_len; ++i) {
+        const Opcode op = program->code[i];
+        if(opcode_is_lexer(op.id)) {
+            if(lexers[op.arg] < 0) {
+                builder.table = arena_reserve(&program->arena, builder.table, &builder.table_cap,
+                    builder.table_len + 1, sizeof(Lexer));
+                builder.table[builder.table_len].classes = -1;
+                builder.table[builder.table_len].trie = -1;
+                lexers[op.arg] = builder.table_len++;
+            }
+            compile_lexer(program, &builder, op.id, &program->strings[op.arg]);
+        }
+    }
+    program->lexer_table = builder.table;
+    program->classes = builder.classes;
+    program->trie = builder.trie.nodes;
 }
 
-void vm_advance(Meta2Vm * self, long i) {
-    assert(self);
-    assert(i > 0);
-    assert(self->input_i + i < self->input_len && "Reached end of input");
-    self->input_i += i;
+#define vm_lexer(program, op) (&(program)->lexer_table[(program)->lexers[(op).arg]])
+
+/*assembles and links META II assembly text into out, which owns the result*/
+void assemble_program(const char * text, long text_len, Program * out) {
+    const char * const end = text + text_len;
+    const char * line = text;
+    Assembler assembler;
+    memset(out, 0, sizeof(Program));
+    memset(&assembler, 0, sizeof(assembler));
+    assembler.program = out;
+    assembler.start_symbol = -1;
+
+    while(line < end) {
+        const char * eol = memchr(line, '\n', end - line);
+        if(eol == NULL) {
+            eol = end;
+        }
+        if(eol > line && !load_line(line, eol, &assembler)) {
+            break;
+        }
+        line = eol + 1;
+    }
+    if(assembler.code_len == 0) {
+        fatal_error(error_program, "Empty program\n");
+    }
+    link_program(&assembler);
+
+    out->code = assembler.code;
+    out->code_len = assembler.code_len;
+    out->labels = assembler.labels;
+    out->labels_len = assembler.labels_len;
+    out->strings = assembler.strings;
+    out->strings_len = assembler.strings_len;
+    compile_lexers(out);
 }
 
-char vm_getch(Meta2Vm * self) {
-    const char ch = vm_input(self)[0];
+/*rule names by isp; where labels share an isp the first one defined names
+  it, which is the rule rather than the loop labels generated inside it,
+  and not a rule -O removed, see sort_dead_labels*/
+const char ** rule_names(const Program * program) {
+    const char ** names = calloc(program->code_len + 1, sizeof(char *));
+    long i = 0;
+    if(names == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+    for(i = program->labels_len - 1; i >= 0; --i) {
+        names[program->labels[i].isp] = &program->strings[program->labels[i].name];
+    }
+    return names;
+}
 
-    if(ch == 0) {
-        return 0;
-    } else {
-        vm_advance(self, 1);
-        return ch;
+/*packrat memoization
+
+  In memo mode every CLL is keyed by (rule, input_i). When a call
+  returns, its outcome is recorded: the switch, where the input ended up,
+  the text it appended to the current output record and the token it left
+  behind. A later call with the same key replays that instead of running
+  the rule again. The incoming switch is not part of the key: a rule
+  compiled by META II always tests something before it branches.
+
+  Only calls whose effects are all replayable are recorded. OUT, LB,
+  generating a label and copying a token the call did not scan itself
+  bump vm->effects, which disqualifies every call in progress.
+
+  META II never moves backwards in the input, so entries keyed before
+  input_i are dead; they are dropped whenever the table would grow.*/
+
+typedef struct {
+    int rule;         /*entry isp, -1 for an empty slot*/
+    long input_i;
+    int switch_out;
+    long input_end;
+    long output;      /*replayed output in Memo.text*/
+    long output_len;
+    long token;       /*token span in the input, -1 when the call left it alone*/
+    long token_len;
+} MemoEntry;
+
+typedef struct {
+    long hits;
+    long misses;
+} MemoCounters;
+
+/*vm state when the frame at the same depth of the vm stack was called*/
+typedef struct {
+    long input_i;
+    long record_len;
+    long effects;
+    long token_serial;
+} MemoFrame;
+
+typedef struct Memo {
+    MemoEntry * entries;
+    long entries_cap;
+    long entries_len;
+    Buffer text;
+    MemoCounters * rules; /*indexed by entry isp*/
+    long rules_len;
+    long hits;
+    long misses;
+    long stores;
+    long rejected;
+    MemoFrame * frames; /*as deep as the vm stack*/
+    long frames_cap;
+} Memo;
+
+void memo_init(Memo * self, const Program * program) {
+    memset(self, 0, sizeof(Memo));
+    self->rules_len = program->code_len;
+    self->rules = calloc(self->rules_len, sizeof(MemoCounters));
+    if(self->rules == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
     }
 }
 
-char vm_peekch(Meta2Vm * self) {
-    assert(self);
-    return vm_input(self)[0];
+void memo_free(Memo * self) {
+    free(self->entries);
+    free(self->rules);
+    free(self->frames);
+    buffer_free(&self->text);
+    memset(self, 0, sizeof(Memo));
 }
 
-Label vm_lookup_label(Meta2Vm * self, const char * name) {
-    int i = 0;
-    assert(name);
-    assert(self);
-    for(i = 0; i < self->labels_len; ++i) {
-        const Label l = self->labels[i];
-        if(strncmp(l.str, name, str_cap) == 0) {
-            return l;
+unsigned long memo_hash(int rule, long input_i) {
+    unsigned long hash = (unsigned long)input_i * 0x9e3779b1UL;
+    hash ^= (unsigned long)rule * 0x85ebca6bUL;
+    return hash ^ (hash >> 15);
+}
+
+MemoEntry * memo_slot(Memo * self, int rule, long input_i) {
+    unsigned long slot = memo_hash(rule, input_i) & (self->entries_cap - 1);
+    for(;; slot = (slot + 1) & (self->entries_cap - 1)) {
+        MemoEntry * entry = &self->entries[slot];
+        if(entry->rule == -1
+            || (entry->rule == rule && entry->input_i == input_i)) {
+            return entry;
         }
     }
-    fatal_error("Undefined label name \"%s\"", name);
 }
 
-
-/*opcode implementations*/
-void vm_tst(Meta2Vm* self, const char * str) {
-    assert(self);
-    assert(str && "tst string is NULL");
-    assert(strnlen(str, str_cap) > 0 && "empty string given as arg");
-    assert(strcspn(str, "'") == strnlen(str, str_cap) && "tst string must not contain single quotes");
-    {
-        const long len = strnlen(str, str_cap);
-        vm_skip_whitespace(self);
-        if(strncmp(str, vm_input(self), len) == 0) {
-            self->switch_flag = 1;
-            vm_advance(self, len);
-        } else {
-            self->switch_flag = 0;
+/*rebuilds the table without the entries before input_i, growing it if still needed*/
+void memo_rehash(Memo * self, long input_i) {
+    MemoEntry * const old = self->entries;
+    const long old_cap = self->entries_cap;
+    Buffer old_text = self->text;
+    long live = 0;
+    long i = 0;
+    for(i = 0; i < old_cap; ++i) {
+        live += old[i].rule != -1 && old[i].input_i >= input_i;
+    }
+    self->entries_cap = old_cap > 0 ? old_cap : 1024;
+    while((live + 1) * 2 > self->entries_cap) {
+        self->entries_cap *= 2;
+    }
+    self->entries = malloc(self->entries_cap * sizeof(MemoEntry));
+    if(self->entries == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+    for(i = 0; i < self->entries_cap; ++i) {
+        self->entries[i].rule = -1;
+    }
+    self->entries_len = 0;
+    memset(&self->text, 0, sizeof(Buffer));
+    for(i = 0; i < old_cap; ++i) {
+        if(old[i].rule != -1 && old[i].input_i >= input_i) {
+            MemoEntry * entry = memo_slot(self, old[i].rule, old[i].input_i);
+            *entry = old[i];
+            entry->output = self->text.len;
+            buffer_append(&self->text, &old_text.data[old[i].output], old[i].output_len);
+            ++self->entries_len;
         }
     }
+    free(old);
+    buffer_free(&old_text);
 }
 
-void vm_id(Meta2Vm * self) {
-    assert(self);
+/*called by CLL; returns 1 if the call was answered from the memo*/
+int memo_replay(Meta2Vm * self, int rule) {
+    Memo * const memo = self->memo;
+    const MemoEntry * entry = NULL;
+    /*every test skips whitespace first, so doing it here makes calls
+      before and after the blanks share an entry*/
     vm_skip_whitespace(self);
-    if(!isalpha(vm_peekch(self))) {
-        self->switch_flag = 0;
-        return;
-    } else {
-        int i = 0;
-        self->switch_flag = 1;
+    if(memo->entries_cap == 0) {
+        return 0;
+    }
+    entry = memo_slot(memo, rule, vm_position(self));
+    if(entry->rule == -1) {
+        ++memo->misses;
+        ++memo->rules[rule].misses;
+        return 0;
+    }
+    ++memo->hits;
+    ++memo->rules[rule].hits;
+    self->switch_flag = entry->switch_out;
+    /*the window still holds it, nothing after input_i is dropped*/
+    self->input_i = entry->input_end - self->input_offset;
+    buffer_append(&self->record, &memo->text.data[entry->output], entry->output_len);
+    if(entry->token >= 0) {
+        /*scanned inside the call, so at or after input_i and still in the window*/
+        self->token = entry->token;
+        self->token_len = entry->token_len;
+        ++self->token_serial;
+    }
+    return 1;
+}
 
-        for(;isalpha(vm_peekch(self)) || isdigit(vm_peekch(self)); ++i) {
-            assert(i + 1 < (long)sizeof(self->token));
-            self->token[i] = vm_getch(self);
-            self->token[i + 1] = 0;
+/*called by CLL for the frame it pushes at depth*/
+void memo_enter(Meta2Vm * self, long depth) {
+    Memo * const memo = self->memo;
+    MemoFrame * frame = NULL;
+    if(depth >= memo->frames_cap) {
+        memo->frames_cap = self->stack_cap;
+        memo->frames = realloc(memo->frames, memo->frames_cap * sizeof(MemoFrame));
+        if(memo->frames == NULL) {
+            fatal_error(error_memory, "Out of memory\n");
         }
     }
+    frame = &memo->frames[depth];
+    frame->input_i = vm_position(self);
+    frame->record_len = self->record.len;
+    frame->effects = self->effects;
+    frame->token_serial = self->token_serial;
 }
 
-
-void vm_num(Meta2Vm * self) {
-    assert(self);
-    vm_skip_whitespace(self);
-    if(!isdigit(vm_peekch(self))) {
-        self->switch_flag = 0;
+/*called by R with the depth of the frame being popped*/
+void memo_store(Meta2Vm * self, long depth, int rule) {
+    Memo * const memo = self->memo;
+    const MemoFrame * const frame = &memo->frames[depth];
+    MemoEntry * entry = NULL;
+    if(frame->effects != self->effects) {
+        ++memo->rejected;
         return;
-    } else {
-        int i = 0;
-        self->switch_flag = 1;
+    }
+    if((memo->entries_len + 1) * 2 > memo->entries_cap) {
+        memo_rehash(memo, vm_position(self) < frame->input_i ? vm_position(self) : frame->input_i);
+    }
+    entry = memo_slot(memo, rule, frame->input_i);
+    if(entry->rule != -1) {
+        return;
+    }
+    assert(self->record.len >= frame->record_len);
+    entry->rule = rule;
+    entry->input_i = frame->input_i;
+    entry->switch_out = self->switch_flag;
+    entry->input_end = vm_position(self);
+    entry->output = memo->text.len;
+    entry->output_len = self->record.len - frame->record_len;
+    buffer_append(&memo->text, &self->record.data[frame->record_len], entry->output_len);
+    entry->token = -1;
+    if(frame->token_serial != self->token_serial) {
+        entry->token = self->token;
+        entry->token_len = self->token_len;
+    }
+    ++memo->entries_len;
+    ++memo->stores;
+}
 
-        for(;isdigit(vm_peekch(self)); ++i) {
-            assert(i + 1 < (long)sizeof(self->token));
-            self->token[i] = vm_getch(self);
-            self->token[i + 1] = 0;
+/*one row per rule entered, the start rule and the targets of CLL*/
+void memo_report(const Memo * self, const Program * program) {
+    const char ** const names = rule_names(program);
+    long i = 0;
+    fprintf(stderr, "memo hits=%ld misses=%ld stores=%ld rejected=%ld\n",
+        self->hits, self->misses, self->stores, self->rejected);
+    for(i = 0; i < self->rules_len; ++i) {
+        if(self->rules[i].hits > 0 || self->rules[i].misses > 0) {
+            fprintf(stderr, "  %-16s hits=%ld misses=%ld\n",
+                names[i] != NULL ? names[i] : "?", self->rules[i].hits, self->rules[i].misses);
         }
     }
+    free((void *)names);
 }
 
-void vm_sr(Meta2Vm * self) {
-    assert(self);
-    vm_skip_whitespace(self);
-    {
-        if(vm_peekch(self) != '\'') {
-            self->switch_flag = 0; 
-            return;
-        } else {
-            int i = 0;
-            self->switch_flag = 1; 
-            self->token[i] = vm_getch(self);
-            self->token[i + 1] = 0;
-            ++i;
+/*incremental reparse
 
-            for(;vm_peekch(self) != '\'' && vm_peekch(self) != 0; ++i) {
-                assert(i + 1 < (long)sizeof(self->token));
-                self->token[i] = vm_getch(self);
-                self->token[i + 1] = 0;
-            }
+  With vm->reparse set, every return into the start rule with an empty
+  output record leaves a Checkpoint. The start rule's frame is the only
+  one left then, so the checkpoint holds everything the rest of the parse
+  depends on besides the input after it. For a META II grammar these are
+  the rounds of the top level $ loop, one per statement.
 
-            if(vm_peekch(self) == 0) {
-                fatal_error("Unexpected end of input");
-            }
+  After an edit, reparse_edit restores the last checkpoint whose lookahead
+  ends before the edit and runs the switch engine from there. Past the
+  edit, a checkpoint equal to one of the last parse at the same distance
+  from the end of the input would run the same from then on, so the old
+  output and checkpoints after it are spliced in and the vm halts. The
+  token has to be one scanned after the edit too. Gensym labels are
+  numbered through the whole output, so an edit that changes how many are
+  generated never resynchronizes and runs to the end. The memo is not used.*/
 
-            assert(vm_peekch(self) == '\'');
-            assert(i + 1 < (long)sizeof(self->token));
-            self->token[i] = vm_getch(self);
-            self->token[i + 1] = 0;
+typedef struct {
+    long position;     /*absolute input position*/
+    int isp;           /*return address, before vm_resume*/
+    int switch_flag;
+    int label_counter;
+    int output_column;
+    long output;       /*bytes of output before this point*/
+    long token;
+    long token_len;
+    int label1;        /*of the start rule's frame*/
+    int label2;
+} Checkpoint;
+
+typedef struct Reparse {
+    Checkpoint * checkpoints;
+    long checkpoints_len;
+    long checkpoints_cap;
+    Buffer output;     /*whole output of the last parse*/
+    int switch_flag;   /*outcome of the last parse*/
+    int valid;         /*0 until a parse completed, the next one is full*/
+    long lookahead;    /*how far past input_i a test may read*/
+
+    /*the last parse while reparse_edit runs*/
+    Checkpoint * old;
+    long old_len;
+    long old_next;
+    Buffer old_output;
+    long edit_end;     /*end of the inserted text*/
+    long delta;        /*bytes inserted minus bytes removed*/
+
+    /*what the last parse did, -1 when it did not*/
+    long resumed;      /*input position it started from*/
+    long synced;       /*input position it rejoined the previous parse*/
+} Reparse;
+
+void reparse_init(Reparse * self, const Program * program) {
+    long i = 0;
+    memset(self, 0, sizeof(Reparse));
+    /*TST reads at most its literal and ANY its longest word, both are in
+      strings; the scanners read one byte past what they take*/
+    self->lookahead = 1;
+    while(i < program->strings_len) {
+        const long len = strlen(&program->strings[i]);
+        if(len > self->lookahead) {
+            self->lookahead = len;
         }
+        i += len + 1;
     }
 }
 
-#define ARRAY_LEN(arr) (long)(sizeof(arr) / sizeof(arr[0]))
+void reparse_free(Reparse * self) {
+    free(self->checkpoints);
+    free(self->old);
+    buffer_free(&self->output);
+    buffer_free(&self->old_output);
+    memset(self, 0, sizeof(Reparse));
+}
 
-void vm_cll(Meta2Vm* self, const char * subroutine_name) {
-    const Label l = vm_lookup_label(self, subroutine_name);
-    if(self->stack_len >= ARRAY_LEN(self->stack)) {
-        fatal_error("Stack overflow");
-    }
-    self->stack[self->stack_len].return_address = self->isp;
-    memset(self->stack[self->stack_len].label1, 0, str_cap);
-    memset(self->stack[self->stack_len].label2, 0, str_cap);
-    self->stack_len += 1;
-    self->isp = l.isp;
+/*vm->output for a reparse, writes what the sink would*/
+int reparse_write(void * user, int column, const char * record, long len) {
+    Reparse * const self = user;
+    write_record(&self->output, NULL, column, record, len);
+    return 0;
 }
 
-void vm_r(Meta2Vm * self) {
-    assert(self);
-    if(self->stack_len <= 0) {
-        fatal_error("Stack underflow");
-    } else {
-        const StackCell cell = self->stack[self->stack_len - 1];
-        self->stack_len -= 1;
-        self->isp = cell.return_address;
+void reparse_push(Reparse * self, const Checkpoint * checkpoint) {
+    if(self->checkpoints_len == self->checkpoints_cap) {
+        self->checkpoints_cap = self->checkpoints_cap > 0 ? self->checkpoints_cap * 2 : 256;
+        self->checkpoints = realloc(self->checkpoints, self->checkpoints_cap * sizeof(Checkpoint));
+        if(self->checkpoints == NULL) {
+            fatal_error(error_memory, "Out of memory\n");
+        }
     }
+    self->checkpoints[self->checkpoints_len++] = *checkpoint;
 }
 
-void vm_set(Meta2Vm * self) {
-    assert(self);
-    self->switch_flag = 1;
+/*copies the rest of the old parse after old[i] in and halts the vm*/
+void reparse_splice(Meta2Vm * vm, Reparse * self, long i) {
+    const long shift = self->output.len - self->old[i].output;
+    buffer_append(&self->output, &self->old_output.data[self->old[i].output],
+        self->old_output.len - self->old[i].output);
+    for(++i; i < self->old_len; ++i) {
+        Checkpoint checkpoint = self->old[i];
+        checkpoint.position += self->delta;
+        checkpoint.output += shift;
+        checkpoint.token += self->delta;
+        reparse_push(self, &checkpoint);
+    }
+    vm->switch_flag = self->switch_flag;
+    vm->isp = halt_address;
 }
 
-void vm_b(Meta2Vm * self, const char * label) {
-    const Label l = vm_lookup_label(self, label);
-    self->isp = l.isp;
+/*the state of a vm that just returned into the start rule*/
+void take_checkpoint(const Meta2Vm * vm, long output, Checkpoint * out) {
+    memset(out, 0, sizeof(Checkpoint));
+    out->position = vm_position(vm);
+    out->isp = vm->isp;
+    out->switch_flag = vm->switch_flag;
+    out->label_counter = vm->label_counter;
+    out->output_column = vm->output_column;
+    out->output = output;
+    out->token = vm->token;
+    out->token_len = vm->token_len;
+    out->label1 = vm->stack[0].label1;
+    out->label2 = vm->stack[0].label2;
 }
 
+/*puts a started vm back where checkpoint was taken, vm_resume goes on*/
+void restore_checkpoint(Meta2Vm * vm, const Checkpoint * checkpoint) {
+    assert(vm->stream == NULL && vm->stack_len == 1);
+    vm->input_i = checkpoint->position;
+    vm->isp = checkpoint->isp;
+    vm->switch_flag = checkpoint->switch_flag;
+    vm->label_counter = checkpoint->label_counter;
+    vm->output_column = checkpoint->output_column;
+    vm->token = checkpoint->token;
+    vm->token_len = checkpoint->token_len;
+    vm->stack[0].label1 = checkpoint->label1;
+    vm->stack[0].label2 = checkpoint->label2;
+}
 
-void vm_bt(Meta2Vm * self, const char * label) {
-    const Label l = vm_lookup_label(self, label);
-    if(self->switch_flag) {
-        self->isp = l.isp;
+/*called by R when it returned into the start rule*/
+void reparse_checkpoint(Meta2Vm * vm) {
+    Reparse * const self = vm->reparse;
+    Checkpoint checkpoint;
+    long i = 0;
+    if(vm->record.len > 0) {
+        return;
+    }
+    take_checkpoint(vm, self->output.len, &checkpoint);
+    reparse_push(self, &checkpoint);
+    if(self->old == NULL || checkpoint.position < self->edit_end
+        || (checkpoint.token_len > 0 && checkpoint.token < self->edit_end)) {
+        return;
+    }
+    /*old checkpoints are in input order*/
+    for(i = self->old_next; i < self->old_len && self->old[i].position + self->delta < checkpoint.position; ++i);
+    self->old_next = i;
+    for(; i < self->old_len && self->old[i].position + self->delta == checkpoint.position; ++i) {
+        const Checkpoint * const old = &self->old[i];
+        if(old->isp == checkpoint.isp && old->switch_flag == checkpoint.switch_flag
+            && old->label_counter == checkpoint.label_counter
+            && old->output_column == checkpoint.output_column
+            && old->token_len == checkpoint.token_len
+            && (old->token_len == 0 || old->token + self->delta == checkpoint.token)
+            && old->label1 == checkpoint.label1 && old->label2 == checkpoint.label2) {
+            self->synced = checkpoint.position;
+            reparse_splice(vm, self, i);
+            return;
+        }
     }
 }
 
+/*parallel parsing
 
-void vm_bf(Meta2Vm * self, const char * label) {
-    const Label l = vm_lookup_label(self, label);
-    if(!self->switch_flag) {
-        self->isp = l.isp;
+  With -j and a single input, run_split cuts the input where top level
+  statements end and parses the pieces on their own threads. Each piece
+  but the first starts from a guessed checkpoint: just returned from the
+  statement rule, no token, no labels. It runs until a checkpoint at or
+  past the start of the next piece whose token was scanned there too,
+  like a reparse rejoining the last parse, and records every checkpoint on
+  the way. Two pieces join where a checkpoint of the earlier one equals
+  one of the later one, up to label numbers: from there both would run
+  the same. Each piece numbers its labels from 0 and notes where it wrote
+  them, so they can be renumbered when the outputs are joined.*/
+
+typedef struct {
+    long output; /*offset of the label text, in the record until written*/
+    int label;
+} LabelSite;
+
+typedef struct Chunk {
+    Meta2Vm vm;
+    long start;        /*input position the piece starts from*/
+    long stop;         /*start of the next piece, -1 for the last one*/
+    int stopped;       /*halted at a checkpoint past stop*/
+    int failed;
+    Checkpoint * checkpoints;
+    long checkpoints_len;
+    long checkpoints_cap;
+    Buffer output;
+    LabelSite * sites;
+    long sites_len;
+    long sites_cap;
+    long sites_written; /*sites before this one are output offsets*/
+} Chunk;
+
+void chunk_push(Chunk * self, const Checkpoint * checkpoint) {
+    if(self->checkpoints_len == self->checkpoints_cap) {
+        self->checkpoints_cap = self->checkpoints_cap > 0 ? self->checkpoints_cap * 2 : 256;
+        self->checkpoints = realloc(self->checkpoints, self->checkpoints_cap * sizeof(Checkpoint));
+        if(self->checkpoints == NULL) {
+            fatal_error(error_memory, "Out of memory\n");
+        }
     }
+    self->checkpoints[self->checkpoints_len++] = *checkpoint;
 }
 
-void vm_be(const Meta2Vm * self) {
-    if(!self->switch_flag) {
-        fatal_error("An unknown error ocurred");
+/*called by R when it returned into the start rule*/
+void chunk_checkpoint(Meta2Vm * vm) {
+    Chunk * const self = vm->chunk;
+    Checkpoint checkpoint;
+    if(vm->record.len > 0) {
+        return;
+    }
+    take_checkpoint(vm, self->output.len, &checkpoint);
+    chunk_push(self, &checkpoint);
+    if(self->stop >= 0 && checkpoint.position >= self->stop
+        && (checkpoint.token_len == 0 || checkpoint.token >= self->stop)) {
+        self->stopped = 1;
+        vm->isp = halt_address;
     }
 }
 
-void vm_ci(Meta2Vm* self) {
-    memmove(&(self->output[self->output_i]), self->token, strnlen(self->token, str_cap));
-    memset(self->token, 0, sizeof(self->token));
+/*called for a label about to be appended to the output record*/
+void chunk_label(Chunk * self, int label) {
+    if(self->sites_len == self->sites_cap) {
+        self->sites_cap = self->sites_cap > 0 ? self->sites_cap * 2 : 256;
+        self->sites = realloc(self->sites, self->sites_cap * sizeof(LabelSite));
+        if(self->sites == NULL) {
+            fatal_error(error_memory, "Out of memory\n");
+        }
+    }
+    self->sites[self->sites_len].output = self->vm.record.len;
+    self->sites[self->sites_len].label = label;
+    ++self->sites_len;
 }
 
-void vm_cl(Meta2Vm * self, const char * literal) {
-    const long len = strnlen(literal, str_cap - 1);
-    memmove(&(self->output[self->output_i]), literal, len + 1);
-    self->output_i = len;
-    self->output[len] = 0;
+/*vm->output for a piece, writes what the sink would*/
+int chunk_write(void * user, int column, const char * record, long len) {
+    Chunk * const self = user;
+    for(; self->sites_written < self->sites_len; ++self->sites_written) {
+        self->sites[self->sites_written].output += self->output.len + column;
+    }
+    write_record(&self->output, NULL, column, record, len);
+    return 0;
 }
 
-void vm_gn1(Meta2Vm * self) {
-    assert(self->stack_len > 0);
-    {
-        StackCell * top = &self->stack[self->stack_len - 1];
-        if(top->label1[0] == 0) {
-            gensym(top->label1, sizeof(top->label1));
-        } 
-        printf("%s\n", top->label1);
+/*bytecode images
+
+  An image is the linked program written out once by "-a" so later runs can
+  map it and execute it in place without parsing any assembly text:
+
+    ImageHeader
+    Opcode  code[code_len]      label operands already resolved
+    Label   labels[labels_len]  names are string pool offsets
+    char    strings[strings_len] interned, NUL separated
+
+  Images are in host byte order; byte_order guards against foreign ones.*/
+
+#define image_magic "M2BC"
+#define image_version 3
+#define image_byte_order 0x01020304
+
+typedef struct {
+    char magic[4];
+    int version;
+    int byte_order;
+    int start;
+    int code_len;
+    int labels_len;
+    int strings_len;
+} ImageHeader;
+
+/*the image is read in place, so these layouts are part of the format*/
+typedef char opcode_layout_check[sizeof(Opcode) == 3 * sizeof(int) ? 1 : -1];
+typedef char label_layout_check[sizeof(Label) == 2 * sizeof(int) ? 1 : -1];
+
+void write_image(const Program * self, const char * filename) {
+    ImageHeader header;
+    FILE * fp = NULL;
+    assert(self);
+    assert(filename);
+    memset(&header, 0, sizeof(header));
+    memmove(header.magic, image_magic, sizeof(header.magic));
+    header.version = image_version;
+    header.byte_order = image_byte_order;
+    header.start = self->start;
+    header.code_len = self->code_len;
+    header.labels_len = self->labels_len;
+    header.strings_len = self->strings_len;
+
+    fp = fopen(filename, "wb");
+    if(fp == NULL) {
+        fatal_error(error_io, "Failed to open \"%s\" for writing\n", filename);
     }
+    if(fwrite(&header, sizeof(header), 1, fp) != 1
+        || fwrite(self->code, sizeof(Opcode), self->code_len, fp) != (size_t)self->code_len
+        || fwrite(self->labels, sizeof(Label), self->labels_len, fp) != (size_t)self->labels_len
+        || fwrite(self->strings, 1, self->strings_len, fp) != (size_t)self->strings_len) {
+        fatal_error(error_io, "Failed to write image \"%s\"\n", filename);
+    }
+    fclose(fp);
 }
 
+int is_image(const char * base, long len) {
+    return len >= (long)sizeof(image_magic) - 1 && memcmp(base, image_magic, sizeof(image_magic) - 1) == 0;
+}
 
-void vm_gn2(Meta2Vm * self) {
-    assert(self->stack_len > 0);
-    {
-        StackCell * top = &self->stack[self->stack_len - 1];
-        if(top->label2[0] == 0) {
-            gensym(top->label2, sizeof(top->label2));
-        } 
-        printf("%s\n", top->label2);
+void validate_image(const Program * self) {
+    long i = 0;
+    for(i = 0; i < self->code_len; ++i) {
+        const Opcode op = self->code[i];
+        if(op.id < 0 || op.id >= ARRAY_LEN(opcode_names) || op.id == opcode_dispatch) {
+            fatal_error(error_program, "Invalid opcode %d at instruction %ld of image\n", (int)op.id, i);
+        }
+        if(opcode_has_label(op.id) && (op.arg < 0 || op.arg >= self->code_len)) {
+            fatal_error(error_program, "Branch target %d out of range at instruction %ld of image\n", op.arg, i);
+        }
+        if(opcode_has_label2(op.id) && (op.arg2 < 0 || op.arg2 >= self->code_len)) {
+            fatal_error(error_program, "Branch target %d out of range at instruction %ld of image\n", op.arg2, i);
+        }
+        if(opcode_has_string(op.id) && (op.arg < 0 || op.arg >= self->strings_len)) {
+            fatal_error(error_program, "String operand %d out of range at instruction %ld of image\n", op.arg, i);
+        }
+    }
+    for(i = 0; i < self->labels_len; ++i) {
+        const Label l = self->labels[i];
+        if(l.isp < 0 || l.isp > self->code_len || l.name < 0 || l.name >= self->strings_len) {
+            fatal_error(error_program, "Invalid label %ld in image\n", i);
+        }
+    }
+    if(self->start < 0 || self->start >= self->code_len) {
+        fatal_error(error_program, "Invalid starting address %d in image\n", self->start);
     }
 }
 
-void vm_lb(Meta2Vm * self) {
-    self->output_column = 0;
-}
+/*points out at a mapped bytecode image, nothing is copied;
+  out takes ownership of the mapping*/
+void load_image(const char * base, long len, const char * filename, Program * out) {
+    ImageHeader header;
+    long expected_size = 0;
 
-void vm_out(Meta2Vm * self) {
-    int i = 0;
-    for(i = 0; i < self->output_column; ++i) {
-        printf(" ");
+    memset(out, 0, sizeof(Program));
+    if(len < (long)sizeof(ImageHeader)) {
+        fatal_error(error_program, "Image \"%s\" is truncated\n", filename);
+    }
+
+    memmove(&header, base, sizeof(header));
+    if(memcmp(header.magic, image_magic, sizeof(header.magic)) != 0
+        || header.byte_order != image_byte_order) {
+        fatal_error(error_program, "\"%s\" is not a bytecode image for this machine\n", filename);
+    }
+    if(header.version != image_version) {
+        fatal_error(error_program, "Image \"%s\" has version %d, expected %d\n", filename, header.version, image_version);
     }
-    printf("%s\n", self->output);
-    memset(self->output, 0, sizeof(self->output));
+    if(header.code_len <= 0 || header.labels_len < 0 || header.strings_len <= 0) {
+        fatal_error(error_program, "Image \"%s\" has a corrupt header\n", filename);
+    }
+    expected_size = (long)sizeof(ImageHeader)
+        + (long)header.code_len * (long)sizeof(Opcode)
+        + (long)header.labels_len * (long)sizeof(Label)
+        + header.strings_len;
+    if(expected_size != len) {
+        fatal_error(error_program, "Image \"%s\" is %ld bytes, header describes %ld\n", filename, len, expected_size);
+    }
+
+    out->image = base;
+    out->image_len = len;
+    out->start = header.start;
+    out->code = (const Opcode *)(base + sizeof(ImageHeader));
+    out->code_len = header.code_len;
+    out->labels = (const Label *)(out->code + header.code_len);
+    out->labels_len = header.labels_len;
+    out->strings = (const char *)(out->labels + header.labels_len);
+    out->strings_len = header.strings_len;
+    if(out->strings[out->strings_len - 1] != 0) {
+        fatal_error(error_program, "Image \"%s\" has an unterminated string pool\n", filename);
+    }
+    validate_image(out);
+    compile_lexers(out);
 }
 
-void run_vm(Meta2Vm* self, char * input, long input_len) {
-    self->input = input;
-    self->input_len = input_len;
-    assert((long)strnlen(input, input_len) == input_len && "given input len is wrong");
-    
-    while(self->input_i < self->input_len) {
-        const Opcode op = self->opcodes[self->isp];
-        printf("Running: %s %s\n", opcode_names[op.id], op.str);
-        ++self->isp;
-        switch(op.id) {
-            case opcode_tst: vm_tst(self, op.str); break;
-            case opcode_id: vm_id(self); break;
-            case opcode_num: vm_num(self); break;
-            case opcode_sr: vm_sr(self); break;
-            case opcode_cll: vm_cll(self, op.str); break;
-            case opcode_r: vm_r(self); break;
-            case opcode_set: vm_set(self); break;
-            case opcode_b: vm_b(self, op.str); break;
-            case opcode_bt: vm_bt(self, op.str); break;
-            case opcode_bf: vm_bf(self, op.str); break;
-            case opcode_be: vm_be(self); break;
-            case opcode_cl: vm_cl(self, op.str); break;
-            case opcode_ci: vm_ci(self); break;
-            case opcode_gn1: vm_gn1(self); break;
-            case opcode_gn2: vm_gn2(self); break;
-            case opcode_lb: vm_lb(self); break;
-            case opcode_out: vm_out(self); break;
-            default:
-                /*invalid opcode*/
-                abort();
-        }
+void free_program(Program * self) {
+    if(self->image != NULL) {
+        unmap_file(self->image, self->image_len);
     }
+    arena_free(&self->arena);
+    memset(self, 0, sizeof(Program));
 }
 
 
-int main(int argc, char** argv) {
-    if(argc != 3) {
-        fatal_error("Expected 2 cli argument, found %d\n", argc - 1); 
-    } else {
-        const char * code_file= argv[1];
-        const char * input_file = argv[2];
-        char code[9000] = {0};
-        char input[9000] = {0};
-        read_file(code_file, code, sizeof(code));
-        read_file(input_file, input, sizeof(input));
-        Meta2Vm vm = {0};
+/*peephole optimizer
+
+  Rewrites a loaded program in place of its code and labels:
+  - jump threading: a branch to B, or to a BT/BF whose outcome is already
+    known from the switch, goes straight to the final destination
+  - no-ops: branches to the next instruction, BE right after SET, and SET
+    when the next instruction overwrites the switch
+  - dead code: anything not reachable from the start rule
+  - superinstructions: TST;BF TST;BE CLL;BT CLL;BF CL;OUT, when the
+    second half is not a branch target
+  - inlining: a CLL of a small rule that calls nothing is replaced by a
+    copy of the rule before anything else runs, see inline_rules; rules
+    no longer called then go with the dead code
 
-        load_vm(code, &vm);
-        run_vm(&vm, input, strnlen(input, sizeof(input)));
+  Removed instructions map to the next surviving one, so labels and
+  branches that pointed at them still land on equivalent code.*/
+
+typedef struct {
+    long code_len;
+    long optimized_len;
+    long rules;
+    long optimized_rules;
+    long inlined;
+    long threaded;
+    long noops;
+    long dead;
+    long fused;
+} OptimizeStats;
+
+int opcode_writes_switch(int id) {
+    return id == opcode_tst || id == opcode_id || id == opcode_num || id == opcode_sr || id == opcode_set
+        || opcode_is_lexer(id);
+}
+
+/*follows target while the instruction there is a branch whose outcome
+  is known; switch_known is -1 for unknown, else the switch value*/
+int thread_branch(const Opcode * code, long code_len, int target, int switch_known) {
+    long steps = 0;
+    for(steps = 0; steps < code_len; ++steps) {
+        const Opcode next = code[target];
+        if(next.id == opcode_b
+            || (next.id == opcode_bt && switch_known == 1)
+            || (next.id == opcode_bf && switch_known == 0)) {
+            target = next.arg;
+        } else if(((next.id == opcode_bt && switch_known == 0) || (next.id == opcode_bf && switch_known == 1))
+            && target + 1 < code_len) {
+            target += 1;
+        } else {
+            break;
+        }
+    }
+    return target;
+}
+
+/*marks branch and call targets, including the start*/
+void find_targets(const Opcode * code, long code_len, int start, char * is_target) {
+    long i = 0;
+    memset(is_target, 0, code_len + 1);
+    is_target[start] = 1;
+    for(i = 0; i < code_len; ++i) {
+        if(opcode_has_label(code[i].id)) {
+            is_target[code[i].arg] = 1;
+        }
+        if(opcode_has_label2(code[i].id)) {
+            is_target[code[i].arg2] = 1;
+        }
     }
-    return 0;
 }
+
+/*rules up to this many instructions, R included, are inlined*/
+#define inline_cap 32
+
+/*the length of the rule at entry if it can be copied to a call site,
+  otherwise 0. It has to call nothing, so copies never nest or recurse,
+  and it must not use GN1/GN2, whose labels belong to its own frame. Its
+  instructions have to be contiguous from entry, with every branch inside.
+  seen is all zero and is left that way.*/
+long inline_body(const Opcode * code, long code_len, int entry, char * seen) {
+    int list[inline_cap];
+    long len = 0;
+    long head = 0;
+    int last = entry;
+    int ok = 1;
+    list[len++] = entry;
+    seen[entry] = 1;
+    while(ok && head < len) {
+        const int isp = list[head++];
+        const Opcode op = code[isp];
+        int next[3];
+        int next_len = 0;
+        int i = 0;
+        if(op.id == opcode_cll || op.id == opcode_cll_bt || op.id == opcode_cll_bf
+            || op.id == opcode_gn1 || op.id == opcode_gn2 || op.id == opcode_dispatch) {
+            ok = 0;
+        }
+        if(op.id != opcode_b && op.id != opcode_r) {
+            next[next_len++] = isp + 1;
+        }
+        if(opcode_has_label(op.id)) {
+            next[next_len++] = op.arg;
+        }
+        if(opcode_has_label2(op.id)) {
+            next[next_len++] = op.arg2;
+        }
+        for(i = 0; ok && i < next_len; ++i) {
+            if(next[i] < entry || next[i] >= code_len || (!seen[next[i]] && len == inline_cap)) {
+                ok = 0;
+            } else if(!seen[next[i]]) {
+                seen[next[i]] = 1;
+                list[len++] = next[i];
+                last = next[i] > last ? next[i] : last;
+            }
+        }
+    }
+    for(head = 0; head < len; ++head) {
+        seen[list[head]] = 0;
+    }
+    return ok && last - entry + 1 == len ? len : 0;
+}
+
+/*rules are the start and whatever CLL calls*/
+long count_rules(const Opcode * code, long code_len, int start, char * seen) {
+    long rules = 1;
+    long i = 0;
+    memset(seen, 0, code_len);
+    seen[start] = 1;
+    for(i = 0; i < code_len; ++i) {
+        if((code[i].id == opcode_cll || code[i].id == opcode_cll_bt || code[i].id == opcode_cll_bf)
+            && !seen[code[i].arg]) {
+            seen[code[i].arg] = 1;
+            ++rules;
+        }
+    }
+    return rules;
+}
+
+/*replaces every CLL of a rule inline_body accepts with a copy of the rule
+  whose R jump to the instruction after the CLL, until no call is left
+  that qualifies. A rule whose calls were all inlined may qualify in the
+  next round. Returns the new code, in the program's arena.*/
+Opcode * inline_rules(Program * program, Opcode * code, long * code_len, Label * labels, long labels_len,
+    int * start, OptimizeStats * stats) {
+    for(;;) {
+        const long len = *code_len;
+        int * const size = malloc((len + 1) * sizeof(int));
+        int * const map = malloc((len + 1) * sizeof(int));
+        char * const seen = calloc(len + 1, 1);
+        Opcode * out = NULL;
+        long out_len = 0;
+        long inlined = 0;
+        long i = 0;
+        if(size == NULL || map == NULL || seen == NULL) {
+            fatal_error(error_memory, "Out of memory\n");
+        }
+        for(i = 0; i < len; ++i) {
+            size[i] = -1;
+        }
+        for(i = 0; i < len; ++i) {
+            const Opcode op = code[i];
+            map[i] = out_len;
+            if(op.id == opcode_cll && op.arg != *start && i + 1 < len) {
+                if(size[op.arg] < 0) {
+                    size[op.arg] = inline_body(code, len, op.arg, seen);
+                }
+                if(size[op.arg] > 0) {
+                    out_len += size[op.arg];
+                    ++inlined;
+                    continue;
+                }
+            }
+            ++out_len;
+        }
+        map[len] = out_len;
+        if(inlined > 0) {
+            out = arena_alloc(&program->arena, out_len * sizeof(Opcode));
+            for(i = 0; i < len; ++i) {
+                const Opcode call = code[i];
+                if(call.id == opcode_cll && call.arg != *start && i + 1 < len && size[call.arg] > 0) {
+                    /*a copy of the rule based at map[i], continuing at map[i + 1]*/
+                    long j = 0;
+                    for(j = 0; j < size[call.arg]; ++j) {
+                        Opcode op = code[call.arg + j];
+                        if(op.id == opcode_r) {
+                            op.id = opcode_b;
+                            op.arg = map[i + 1];
+                        } else {
+                            if(opcode_has_label(op.id)) {
+                                op.arg = map[i] + (op.arg - call.arg);
+                            }
+                            if(opcode_has_label2(op.id)) {
+                                op.arg2 = map[i] + (op.arg2 - call.arg);
+                            }
+                        }
+                        out[map[i] + j] = op;
+                    }
+                } else {
+                    Opcode op = call;
+                    if(opcode_has_label(op.id)) {
+                        op.arg = map[op.arg];
+                    }
+                    if(opcode_has_label2(op.id)) {
+                        op.arg2 = map[op.arg2];
+                    }
+                    out[map[i]] = op;
+                }
+            }
+            for(i = 0; i < labels_len; ++i) {
+                labels[i].isp = map[labels[i].isp];
+            }
+            *start = map[*start];
+            *code_len = out_len;
+            code = out;
+            stats->inlined += inlined;
+        }
+        free(size);
+        free(map);
+        free(seen);
+        if(inlined == 0) {
+            return code;
+        }
+    }
+}
+
+/*drops the instructions that are not kept and renumbers everything*/
+void compact_code(Opcode * code, long * code_len, Label * labels, long labels_len, int * start, const char * keep) {
+    int * const map = malloc((*code_len + 1) * sizeof(int));
+    long len = 0;
+    long i = 0;
+    if(map == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+    for(i = 0; i < *code_len; ++i) {
+        map[i] = len;
+        len += keep[i] != 0;
+    }
+    map[*code_len] = len;
+    /*removed instructions continue at the next kept one*/
+    for(i = *code_len - 1; i >= 0; --i) {
+        if(!keep[i]) {
+            map[i] = map[i + 1];
+        }
+    }
+    len = 0;
+    for(i = 0; i < *code_len; ++i) {
+        if(keep[i]) {
+            Opcode op = code[i];
+            if(opcode_has_label(op.id)) {
+                op.arg = map[op.arg];
+            }
+            if(opcode_has_label2(op.id)) {
+                op.arg2 = map[op.arg2];
+            }
+            code[len++] = op;
+        }
+    }
+    for(i = 0; i < labels_len; ++i) {
+        labels[i].isp = map[labels[i].isp];
+    }
+    *start = map[*start];
+    *code_len = len;
+    free(map);
+}
+
+/*moves the labels of code that is not kept after the others, keeping
+  their order; they land on whatever code follows, and the first label at
+  an isp is the one that names it, see rule_names*/
+void sort_dead_labels(Label * labels, long labels_len, const char * keep, long code_len) {
+    Label * const sorted = malloc((labels_len + 1) * sizeof(Label));
+    long sorted_len = 0;
+    long i = 0;
+    if(sorted == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+    for(i = 0; i < labels_len; ++i) {
+        if(labels[i].isp >= code_len || keep[labels[i].isp]) {
+            sorted[sorted_len++] = labels[i];
+        }
+    }
+    for(i = 0; i < labels_len; ++i) {
+        if(labels[i].isp < code_len && !keep[labels[i].isp]) {
+            sorted[sorted_len++] = labels[i];
+        }
+    }
+    memcpy(labels, sorted, labels_len * sizeof(Label));
+    free(sorted);
+}
+
+void optimize_program(Program * program, OptimizeStats * stats) {
+    const long labels_len = program->labels_len;
+    long code_len = program->code_len;
+    Opcode * code = arena_alloc(&program->arena, code_len * sizeof(Opcode));
+    Label * const labels = arena_alloc(&program->arena, (labels_len + 1) * sizeof(Label));
+    char * keep = NULL;
+    char * is_target = NULL;
+    int * work = NULL;
+    long work_len = 0;
+    int start = program->start;
+    long i = 0;
+    memcpy(code, program->code, code_len * sizeof(Opcode));
+    memcpy(labels, program->labels, labels_len * sizeof(Label));
+    memset(stats, 0, sizeof(OptimizeStats));
+
+    code = inline_rules(program, code, &code_len, labels, labels_len, &start, stats);
+    keep = malloc(code_len + 1);
+    is_target = malloc(code_len + 1);
+    work = malloc(code_len * sizeof(int));
+    if(keep == NULL || is_target == NULL || work == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+    stats->rules = count_rules(program->code, program->code_len, program->start, keep);
+
+    for(i = 0; i < code_len; ++i) {
+        Opcode * const op = &code[i];
+        const int known = op->id == opcode_bt ? 1 : op->id == opcode_bf ? 0 : -1;
+        if(op->id == opcode_b || op->id == opcode_bt || op->id == opcode_bf) {
+            const int target = thread_branch(code, code_len, op->arg, known);
+            stats->threaded += target != op->arg;
+            op->arg = target;
+        }
+    }
+
+    find_targets(code, code_len, start, is_target);
+    for(i = 0; i < code_len; ++i) {
+        const Opcode op = code[i];
+        keep[i] = 1;
+        if((op.id == opcode_b || op.id == opcode_bt || op.id == opcode_bf) && op.arg == i + 1) {
+            keep[i] = 0;
+        } else if(op.id == opcode_be && i > 0 && code[i - 1].id == opcode_set && !is_target[i]) {
+            keep[i] = 0;
+        }
+    }
+    for(i = 0; i < code_len; ++i) {
+        long next = i + 1;
+        while(next < code_len && !keep[next]) {
+            ++next;
+        }
+        if(code[i].id == opcode_set && next < code_len && opcode_writes_switch(code[next].id)) {
+            keep[i] = 0;
+        }
+    }
+    for(i = 0; i < code_len; ++i) {
+        stats->noops += !keep[i];
+    }
+    compact_code(code, &code_len, labels, labels_len, &start, keep);
+
+    /*reachability from the start rule*/
+    memset(keep, 0, code_len);
+    work[work_len++] = start;
+    keep[start] = 1;
+    while(work_len > 0) {
+        const int isp = work[--work_len];
+        const Opcode op = code[isp];
+        int next[3];
+        int next_len = 0;
+        if(op.id != opcode_b && op.id != opcode_r && isp + 1 < code_len) {
+            next[next_len++] = isp + 1;
+        }
+        if(opcode_has_label(op.id)) {
+            next[next_len++] = op.arg;
+        }
+        if(opcode_has_label2(op.id)) {
+            next[next_len++] = op.arg2;
+        }
+        while(next_len > 0) {
+            const int to = next[--next_len];
+            if(!keep[to]) {
+                keep[to] = 1;
+                work[work_len++] = to;
+            }
+        }
+    }
+    for(i = 0; i < code_len; ++i) {
+        stats->dead += !keep[i];
+    }
+    sort_dead_labels(labels, labels_len, keep, code_len);
+    compact_code(code, &code_len, labels, labels_len, &start, keep);
+
+    find_targets(code, code_len, start, is_target);
+    for(i = 0; i < code_len; ++i) {
+        keep[i] = 1;
+    }
+    for(i = 0; i + 1 < code_len; ++i) {
+        Opcode * const op = &code[i];
+        const Opcode next = code[i + 1];
+        int fused = -1;
+        if(!keep[i] || is_target[i + 1]) {
+            continue;
+        }
+        if(op->id == opcode_tst && next.id == opcode_bf) fused = opcode_tst_bf;
+        else if(op->id == opcode_tst && next.id == opcode_be) fused = opcode_tst_be;
+        else if(op->id == opcode_cll && next.id == opcode_bt) fused = opcode_cll_bt;
+        else if(op->id == opcode_cll && next.id == opcode_bf) fused = opcode_cll_bf;
+        else if(op->id == opcode_cl && next.id == opcode_out) fused = opcode_cl_out;
+        if(fused != -1) {
+            op->id = fused;
+            op->arg2 = next.arg;
+            keep[i + 1] = 0;
+            ++stats->fused;
+        }
+    }
+    compact_code(code, &code_len, labels, labels_len, &start, keep);
+
+    stats->code_len = program->code_len;
+    stats->optimized_len = code_len;
+    stats->optimized_rules = count_rules(code, code_len, start, keep);
+    program->code = code;
+    program->code_len = code_len;
+    program->labels = labels;
+    program->start = start;
+    free(keep);
+    free(is_target);
+    free(work);
+}
+
+void optimize_report(const OptimizeStats * stats) {
+    fprintf(stderr, "optimize instructions=%ld->%ld rules=%ld->%ld inlined=%ld threaded=%ld noops=%ld dead=%ld fused=%ld\n",
+        stats->code_len, stats->optimized_len, stats->rules, stats->optimized_rules, stats->inlined,
+        stats->threaded, stats->noops, stats->dead, stats->fused);
+}
+
+/*FIRST-set prediction
+
+  A rule is predictable when every path through it that has not yet
+  consumed input ends in a plain failure: the switch is false at R and
+  nothing was output on the way. Its FIRST set holds the characters that
+  can start any of its tests. If the next non-blank character is not in
+  the set, CLL fails at once without entering the rule.
+
+  Alternatives form chains of tests where each failure falls through to
+  the next test. Each chain of at least three tests gets a DISPATCH in
+  front of its head. DISPATCH looks at the next character and jumps
+  straight to the first test in the chain that can succeed, or to where
+  the chain ends after all of them fail.*/
+
+typedef struct {
+    long rules;
+    long predictable;
+    long dispatches;
+} PredictStats;
+
+typedef struct {
+    const Program * program;
+    const Opcode * code;
+    long code_len;
+    int * rule_first;   /*per isp, -2 if no rule starts there*/
+    CharSet * sets;
+    long sets_len;
+    unsigned char * visited; /*per isp, bit per switch state*/
+    int * work;
+    long * touched;
+} Predictor;
+
+int charset_union(CharSet * self, const CharSet * other) {
+    int changed = 0;
+    int i = 0;
+    for(i = 0; i < (int)sizeof(self->bits); ++i) {
+        changed |= (other->bits[i] & ~self->bits[i]) != 0;
+        self->bits[i] |= other->bits[i];
+    }
+    return changed;
+}
+
+void charset_add_class(CharSet * self, int class) {
+    int ch = 0;
+    for(ch = 0; ch < 256; ++ch) {
+        if(char_is(ch, class)) {
+            self->bits[ch >> 3] |= 1 << (ch & 7);
+        }
+    }
+}
+
+int opcode_is_test(int id) {
+    return id == opcode_tst || id == opcode_id || id == opcode_num || id == opcode_sr || id == opcode_cll
+        || opcode_is_lexer(id)
+        || id == opcode_tst_bf || id == opcode_tst_be || id == opcode_cll_bt || id == opcode_cll_bf;
+}
+
+/*where a failed test continues, -1 for BE*/
+int test_failure(Opcode op, int isp) {
+    switch(op.id) {
+        case opcode_tst_bf:
+        case opcode_cll_bf: return op.arg2;
+        case opcode_tst_be: return -1;
+        default: return isp + 1;
+    }
+}
+
+/*the characters a test can succeed on; returns 0 if that is not known*/
+int test_first(const Predictor * self, const char * strings, Opcode op, CharSet * out) {
+    memset(out, 0, sizeof(CharSet));
+    switch(op.id) {
+        case opcode_tst:
+        case opcode_tst_bf:
+        case opcode_tst_be:
+            out->bits[(unsigned char)strings[op.arg] >> 3] |= 1 << (strings[op.arg] & 7);
+            return 1;
+        case opcode_id: charset_add_class(out, class_alpha); return 1;
+        case opcode_num: charset_add_class(out, class_digit); return 1;
+        case opcode_sr: out->bits['\'' >> 3] |= 1 << ('\'' & 7); return 1;
+        case opcode_chr:
+        case opcode_tok:
+            *out = self->program->classes[vm_lexer(self->program, op)->classes];
+            return 1;
+        case opcode_any: {
+            const TrieNode * const root = &self->program->trie[vm_lexer(self->program, op)->trie];
+            int ch = 0;
+            for(ch = 0; ch < 256; ++ch) {
+                if(root->next[ch] != 0) {
+                    charset_add(out, ch);
+                }
+            }
+            return 1;
+        }
+        default:
+            if(self->rule_first[op.arg] < 0) {
+                return 0;
+            }
+            *out = self->sets[self->rule_first[op.arg]];
+            return 1;
+    }
+}
+
+void predict_push(Predictor * self, long * work_len, long * touched_len, int isp, int switch_state) {
+    const unsigned char bit = 1 << switch_state;
+    if(self->visited[isp] == 0) {
+        self->touched[(*touched_len)++] = isp;
+    }
+    if(!(self->visited[isp] & bit)) {
+        self->visited[isp] |= bit;
+        self->work[(*work_len)++] = isp * 3 + switch_state;
+    }
+}
+
+/*walks the rule at entry until input would be consumed;
+  returns 0 if the rule is not predictable, else grows out*/
+int predict_rule(Predictor * self, const char * strings, int entry, CharSet * out) {
+    enum { off, on, unknown };
+    long work_len = 0;
+    long touched_len = 0;
+    int predictable = 1;
+    predict_push(self, &work_len, &touched_len, entry, unknown);
+    while(work_len > 0 && predictable) {
+        const int item = self->work[--work_len];
+        const int isp = item / 3;
+        const int sw = item % 3;
+        const Opcode op = self->code[isp];
+        CharSet first;
+        if(opcode_is_test(op.id)) {
+            const int failure = test_failure(op, isp);
+            if(!test_first(self, strings, op, &first) || failure < 0) {
+                predictable = 0;
+            } else {
+                charset_union(out, &first);
+                predict_push(self, &work_len, &touched_len, failure, off);
+            }
+            continue;
+        }
+        switch(op.id) {
+            case opcode_b: predict_push(self, &work_len, &touched_len, op.arg, sw); break;
+            case opcode_bt:
+            case opcode_bf:
+                if(sw == unknown || (sw == on) == (op.id == opcode_bt)) {
+                    predict_push(self, &work_len, &touched_len, op.arg, sw == unknown ? (op.id == opcode_bt ? on : off) : sw);
+                }
+                if(sw == unknown || (sw == on) != (op.id == opcode_bt)) {
+                    predict_push(self, &work_len, &touched_len, isp + 1, sw == unknown ? (op.id == opcode_bt ? off : on) : sw);
+                }
+                break;
+            case opcode_set: predict_push(self, &work_len, &touched_len, isp + 1, on); break;
+            case opcode_be:
+                if(sw != on) {
+                    predictable = 0;
+                } else {
+                    predict_push(self, &work_len, &touched_len, isp + 1, on);
+                }
+                break;
+            case opcode_r:
+                predictable = sw == off;
+                break;
+            default:
+                /*output before any input was consumed*/
+                predictable = 0;
+        }
+    }
+    while(touched_len > 0) {
+        self->visited[self->touched[--touched_len]] = 0;
+    }
+    return predictable;
+}
+
+int test_may_succeed(const Predictor * self, const char * strings, Opcode op, int ch) {
+    CharSet first;
+    return !test_first(self, strings, op, &first) || charset_has(&first, ch);
+}
+
+/*follows the branches taken after the test at isp fails with the switch
+  off; returns where they lead, -1 after TST_BE*/
+int skip_failure(const Predictor * self, int isp) {
+    long steps = 0;
+    isp = test_failure(self->code[isp], isp);
+    for(steps = 0; steps < self->code_len && isp >= 0; ++steps) {
+        const Opcode op = self->code[isp];
+        if(op.id == opcode_b || op.id == opcode_bf) {
+            isp = op.arg;
+        } else if(op.id == opcode_bt) {
+            isp = isp + 1;
+        } else {
+            break;
+        }
+    }
+    return isp;
+}
+
+/*the next test in the chain after the test at isp, -1 at the end*/
+int chain_next(const Predictor * self, int isp) {
+    isp = skip_failure(self, isp);
+    return isp >= 0 && opcode_is_test(self->code[isp].id) && self->code[isp].id != opcode_tst_be ? isp : -1;
+}
+
+/*where the test at isp continues when it fails on ch: the first later test
+  in the chain that may succeed on ch, or whatever ends the chain*/
+int predict_failure(const Predictor * self, const char * strings, int isp, int ch) {
+    long steps = 0;
+    for(steps = 0; steps < self->code_len; ++steps) {
+        const int next = chain_next(self, isp);
+        if(next < 0) {
+            return skip_failure(self, isp);
+        } else if(test_may_succeed(self, strings, self->code[next], ch)) {
+            return next;
+        }
+        isp = next;
+    }
+    return isp;
+}
+
+void predict_program(Program * program, PredictStats * stats) {
+    Predictor self;
+    const long code_len = program->code_len;
+    char * const in_chain = calloc(code_len, 1);
+    char * const is_head = calloc(code_len, 1);
+    int * const entry = malloc((code_len + 1) * sizeof(int));
+    int * const at = malloc(code_len * sizeof(int));
+    int * rule_first = NULL;
+    int * tables = NULL;
+    Opcode * code = NULL;
+    Label * labels = NULL;
+    long heads = 0;
+    long i = 0;
+    int changed = 1;
+
+    memset(&self, 0, sizeof(self));
+    memset(stats, 0, sizeof(PredictStats));
+    self.program = program;
+    self.code = program->code;
+    self.code_len = code_len;
+    self.rule_first = malloc(code_len * sizeof(int));
+    self.visited = calloc(code_len, 1);
+    self.work = malloc(code_len * 3 * sizeof(int));
+    self.touched = malloc(code_len * sizeof(long));
+    if(in_chain == NULL || is_head == NULL || entry == NULL || at == NULL
+        || self.rule_first == NULL || self.visited == NULL || self.work == NULL || self.touched == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+
+    /*rules are the call targets and the start*/
+    for(i = 0; i < code_len; ++i) {
+        self.rule_first[i] = -2;
+    }
+    self.rule_first[program->start] = 0;
+    for(i = 0; i < code_len; ++i) {
+        if(program->code[i].id == opcode_cll || program->code[i].id == opcode_cll_bt || program->code[i].id == opcode_cll_bf) {
+            self.rule_first[program->code[i].arg] = 0;
+        }
+    }
+    for(i = 0; i < code_len; ++i) {
+        if(self.rule_first[i] == 0) {
+            self.rule_first[i] = self.sets_len++;
+        }
+    }
+    self.sets = arena_alloc(&program->arena, (self.sets_len + 1) * sizeof(CharSet));
+    memset(self.sets, 0, (self.sets_len + 1) * sizeof(CharSet));
+
+    /*sets only grow and rules only become unpredictable, so this settles*/
+    while(changed) {
+        changed = 0;
+        for(i = 0; i < code_len; ++i) {
+            const int set = self.rule_first[i];
+            if(set >= 0) {
+                CharSet first = self.sets[set];
+                if(!predict_rule(&self, program->strings, i, &first)) {
+                    self.rule_first[i] = -1;
+                    changed = 1;
+                } else if(charset_union(&self.sets[set], &first)) {
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    /*chain heads: tests no other test falls into, followed by two more*/
+    for(i = 0; i < code_len; ++i) {
+        if(opcode_is_test(program->code[i].id) && program->code[i].id != opcode_tst_be) {
+            const int next = chain_next(&self, i);
+            if(next >= 0) {
+                in_chain[next] = 1;
+                is_head[i] = chain_next(&self, next) >= 0;
+            }
+        }
+    }
+    for(i = 0; i < code_len; ++i) {
+        if(in_chain[i]) {
+            is_head[i] = 0;
+        }
+        heads += is_head[i];
+    }
+
+    /*make room for a DISPATCH in front of every head*/
+    {
+        long shift = 0;
+        for(i = 0; i < code_len; ++i) {
+            shift += is_head[i];
+            at[i] = i + shift;
+            entry[i] = at[i] - is_head[i];
+        }
+        entry[code_len] = code_len + shift;
+    }
+    code = arena_alloc(&program->arena, (code_len + heads) * sizeof(Opcode));
+    labels = arena_alloc(&program->arena, (program->labels_len + 1) * sizeof(Label));
+    tables = arena_alloc(&program->arena, (heads * 256 + 1) * sizeof(int));
+    rule_first = arena_alloc(&program->arena, (code_len + heads) * sizeof(int));
+    heads = 0;
+    for(i = 0; i < code_len; ++i) {
+        Opcode op = program->code[i];
+        if(is_head[i]) {
+            Opcode dispatch = {0};
+            int ch = 0;
+            dispatch.id = opcode_dispatch;
+            dispatch.arg = heads * 256;
+            for(ch = 0; ch < 256; ++ch) {
+                int target = i;
+                if(!test_may_succeed(&self, program->strings, op, ch)) {
+                    target = predict_failure(&self, program->strings, i, ch);
+                }
+                tables[heads * 256 + ch] = at[target];
+            }
+            rule_first[entry[i]] = self.rule_first[i] >= 0 ? self.rule_first[i] : -1;
+            code[entry[i]] = dispatch;
+            ++heads;
+        }
+        if(opcode_has_label(op.id)) {
+            op.arg = entry[op.arg];
+        }
+        if(opcode_has_label2(op.id)) {
+            op.arg2 = entry[op.arg2];
+        }
+        rule_first[at[i]] = is_head[i] || self.rule_first[i] < 0 ? -1 : self.rule_first[i];
+        code[at[i]] = op;
+    }
+    for(i = 0; i < program->labels_len; ++i) {
+        labels[i] = program->labels[i];
+        labels[i].isp = entry[labels[i].isp];
+    }
+
+    for(i = 0; i < code_len; ++i) {
+        stats->rules += self.rule_first[i] != -2;
+        stats->predictable += self.rule_first[i] >= 0;
+    }
+    stats->dispatches = heads;
+    program->start = entry[program->start];
+    program->code = code;
+    program->code_len = code_len + heads;
+    program->labels = labels;
+    program->rule_first = rule_first;
+    program->first_sets = self.sets;
+    program->jump_tables = tables;
+
+    free(in_chain);
+    free(is_head);
+    free(entry);
+    free(at);
+    free(self.rule_first);
+    free(self.visited);
+    free(self.work);
+    free(self.touched);
+}
+
+void predict_report(const PredictStats * stats, const Meta2Vm * vm) {
+    fprintf(stderr, "predict rules=%ld predictable=%ld dispatches=%ld calls_failed=%ld jumps=%ld\n",
+        stats->rules, stats->predictable, stats->dispatches, vm->predicted_calls, vm->predicted_jumps);
+}
+
+/*load-time verifier
+
+  Walks every instruction reachable from the start and from the rules it
+  calls and proves that each branch, call and dispatch lands inside the
+  program and that no path runs off its end, so every path ends in R,
+  fails at BE or loops. Loading already checked the operands. GN1/GN2 need
+  a frame, which they always have since the start rule runs in stack[0].
+  TST literals are checked here instead of on every TST.
+
+  Only verified programs run on the threaded and jit engines and on the
+  switch engine without its per instruction bounds check; anything else
+  runs on the checked switch loop. Run it again after rewriting the code.*/
+int verify_program(Program * program) {
+    const Opcode * const code = program->code;
+    char * const seen = calloc(program->code_len + 1, 1);
+    int * const work = malloc((program->code_len + 1) * sizeof(int));
+    long * const lens = arena_alloc(&program->arena, (program->code_len + 1) * sizeof(long));
+    long work_len = 0;
+    int ok = program->start >= 0 && program->start < program->code_len;
+    if(seen == NULL || work == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+    memset(lens, 0, (program->code_len + 1) * sizeof(long));
+    if(ok) {
+        seen[program->start] = 1;
+        work[work_len++] = program->start;
+    }
+    while(ok && work_len > 0) {
+        const int isp = work[--work_len];
+        const Opcode op = code[isp];
+        int next[258];
+        int next_len = 0;
+        int i = 0;
+        if(op.id < 0 || op.id >= ARRAY_LEN(opcode_names)) {
+            ok = 0;
+            break;
+        }
+        if(opcode_has_string(op.id)) {
+            /*counted once here instead of on every TST and CL*/
+            ok = op.arg >= 0 && op.arg < program->strings_len;
+            lens[isp] = ok ? (long)strlen(&program->strings[op.arg]) : 0;
+        }
+        if(ok && (op.id == opcode_tst || op.id == opcode_tst_bf || op.id == opcode_tst_be)) {
+            const char * const literal = &program->strings[op.arg];
+            ok = literal[0] != 0 && strchr(literal, '\'') == NULL;
+        }
+        if(op.id == opcode_dispatch) {
+            for(i = 0; i < 256; ++i) {
+                next[next_len++] = program->jump_tables[op.arg + i];
+            }
+        } else {
+            if(op.id != opcode_b && op.id != opcode_r) {
+                next[next_len++] = isp + 1;
+            }
+            if(opcode_has_label(op.id)) {
+                next[next_len++] = op.arg;
+            }
+            if(opcode_has_label2(op.id)) {
+                next[next_len++] = op.arg2;
+            }
+        }
+        for(i = 0; ok && i < next_len; ++i) {
+            if(next[i] < 0 || next[i] >= program->code_len) {
+                ok = 0;
+            } else if(!seen[next[i]]) {
+                seen[next[i]] = 1;
+                work[work_len++] = next[i];
+            }
+        }
+    }
+    free(seen);
+    free(work);
+    program->verified = ok;
+    program->literal_lens = ok ? lens : NULL;
+    return ok;
+}
+
+/*profiler
+
+  -P file profiles a run, on the switch engine. Rule calls and returns
+  walk a call tree whose nodes count the instructions and time spent with
+  them on top of the vm stack; the tree is written as folded stacks, one
+  "PROGRAM;ST;EX1 1234" line per path weighted by instructions, which
+  flamegraph.pl, inferno and speedscope read. Per rule it also keeps
+  calls, failed calls and inclusive counts, summed over outermost
+  activations only so recursion is not counted twice, and per test
+  instruction how often it ran and failed.*/
+
+typedef struct {
+    int rule;          /*entry isp*/
+    long parent;       /*-1 for the start rule*/
+    long child;        /*first child, -1 if none*/
+    long sibling;
+    long instructions; /*executed with this node on top of the stack*/
+    double seconds;
+} ProfileNode;
+
+typedef struct {
+    long calls;
+    long fails;
+    long self_instructions;
+    long instructions;
+    double self_seconds;
+    double seconds;
+    int active; /*activations on the vm stack*/
+} ProfileRule;
+
+typedef struct {
+    long runs;
+    long fails;
+} ProfileSite;
+
+typedef struct Profile {
+    ProfileNode * nodes;
+    long nodes_len;
+    long nodes_cap;
+    long current; /*node of the running rule, -1 after the vm halts*/
+    int isp;      /*instruction being profiled*/
+    long depth;   /*vm stack depth before it*/
+    ProfileRule * rules; /*indexed by entry isp*/
+    ProfileSite * sites; /*indexed by isp*/
+
+    /*instruction count and time of the last call or return*/
+    long mark_instructions;
+    double mark_seconds;
+    /*the same when the frame at each depth was pushed*/
+    long * entry_instructions;
+    double * entry_seconds;
+    long entries_cap;
+} Profile;
+
+void profile_init(Profile * self, const Program * program) {
+    memset(self, 0, sizeof(Profile));
+    self->rules = calloc(program->code_len, sizeof(ProfileRule));
+    self->sites = calloc(program->code_len, sizeof(ProfileSite));
+    if(self->rules == NULL || self->sites == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+    self->current = -1;
+}
+
+void profile_free(Profile * self) {
+    free(self->nodes);
+    free(self->rules);
+    free(self->sites);
+    free(self->entry_instructions);
+    free(self->entry_seconds);
+    memset(self, 0, sizeof(Profile));
+}
+
+/*charges what ran since the last event to the running rule*/
+void profile_account(Profile * self, const Meta2Vm * vm) {
+    const double now = seconds_now();
+    if(self->current >= 0) {
+        ProfileNode * const node = &self->nodes[self->current];
+        ProfileRule * const rule = &self->rules[node->rule];
+        node->instructions += vm->instructions - self->mark_instructions;
+        node->seconds += now - self->mark_seconds;
+        rule->self_instructions += vm->instructions - self->mark_instructions;
+        rule->self_seconds += now - self->mark_seconds;
+    }
+    self->mark_instructions = vm->instructions;
+    self->mark_seconds = now;
+}
+
+/*moves down the call tree into rule, depth is the index of its frame*/
+void profile_enter(Profile * self, int rule, long depth) {
+    ProfileRule * const stats = &self->rules[rule];
+    long node = self->current >= 0 ? self->nodes[self->current].child : -1;
+    while(node >= 0 && self->nodes[node].rule != rule) {
+        node = self->nodes[node].sibling;
+    }
+    if(node < 0) {
+        ProfileNode * added = NULL;
+        if(self->nodes_len >= self->nodes_cap) {
+            self->nodes_cap = self->nodes_cap > 0 ? self->nodes_cap * 2 : 256;
+            self->nodes = realloc(self->nodes, self->nodes_cap * sizeof(ProfileNode));
+            if(self->nodes == NULL) {
+                fatal_error(error_memory, "Out of memory\n");
+            }
+        }
+        node = self->nodes_len++;
+        added = &self->nodes[node];
+        memset(added, 0, sizeof(ProfileNode));
+        added->rule = rule;
+        added->parent = self->current;
+        added->child = -1;
+        added->sibling = -1;
+        if(self->current >= 0) {
+            added->sibling = self->nodes[self->current].child;
+            self->nodes[self->current].child = node;
+        }
+    }
+    self->current = node;
+    ++stats->calls;
+    if(depth >= self->entries_cap) {
+        self->entries_cap = self->entries_cap > 0 ? self->entries_cap * 2 : 256;
+        self->entry_instructions = realloc(self->entry_instructions, self->entries_cap * sizeof(long));
+        self->entry_seconds = realloc(self->entry_seconds, self->entries_cap * sizeof(double));
+        if(self->entry_instructions == NULL || self->entry_seconds == NULL) {
+            fatal_error(error_memory, "Out of memory\n");
+        }
+    }
+    self->entry_instructions[depth] = self->mark_instructions;
+    self->entry_seconds[depth] = self->mark_seconds;
+    ++stats->active;
+}
+
+/*moves back up from the running rule, whose frame was at depth*/
+void profile_leave(Profile * self, int switch_flag, long depth) {
+    ProfileRule * const stats = &self->rules[self->nodes[self->current].rule];
+    stats->fails += !switch_flag;
+    if(--stats->active == 0) {
+        stats->instructions += self->mark_instructions - self->entry_instructions[depth];
+        stats->seconds += self->mark_seconds - self->entry_seconds[depth];
+    }
+    self->current = self->nodes[self->current].parent;
+}
+
+void profile_start(Profile * self, const Meta2Vm * vm) {
+    profile_account(self, vm);
+    profile_enter(self, vm->program->start, 0);
+}
+
+/*called after the switch engine ran the instruction at self->isp*/
+void profile_step(Profile * self, const Meta2Vm * vm, int id) {
+    const long depth = self->depth;
+    if(vm->stack_len > depth) {
+        profile_account(self, vm);
+        /*CLL left isp at the rule it entered*/
+        profile_enter(self, vm->isp, depth);
+    } else if(vm->stack_len < depth) {
+        profile_account(self, vm);
+        profile_leave(self, vm->switch_flag, vm->stack_len);
+    } else if(opcode_is_test(id) && id != opcode_cll && id != opcode_cll_bt && id != opcode_cll_bf) {
+        ++self->sites[self->isp].runs;
+        self->sites[self->isp].fails += !vm->switch_flag;
+    }
+}
+
+void profile_write_folded(const Profile * self, const Program * program, const char * filename) {
+    const char ** const names = rule_names(program);
+    FILE * const out = fopen(filename, "w");
+    long * const path = malloc((self->nodes_len + 1) * sizeof(long));
+    long i = 0;
+    if(out == NULL) {
+        fatal_error(error_io, "Failed to open \"%s\" for writing\n", filename);
+    }
+    if(path == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+    for(i = 0; i < self->nodes_len; ++i) {
+        long path_len = 0;
+        long node = i;
+        if(self->nodes[i].instructions == 0) {
+            continue;
+        }
+        for(; node >= 0; node = self->nodes[node].parent) {
+            path[path_len++] = node;
+        }
+        while(path_len-- > 0) {
+            const int rule = self->nodes[path[path_len]].rule;
+            if(names[rule] != NULL) {
+                fprintf(out, "%s", names[rule]);
+            } else {
+                fprintf(out, "@%d", rule);
+            }
+            fputc(path_len > 0 ? ';' : ' ', out);
+        }
+        fprintf(out, "%ld\n", self->nodes[i].instructions);
+    }
+    if(fclose(out) != 0) {
+        fatal_error(error_io, "Failed to write \"%s\"\n", filename);
+    }
+    free(path);
+    free((void *)names);
+}
+
+typedef struct {
+    long key;
+    long isp;
+} ProfileRank;
+
+int profile_rank_compare(const void * a, const void * b) {
+    const ProfileRank * const left = a;
+    const ProfileRank * const right = b;
+    if(left->key != right->key) {
+        return left->key > right->key ? -1 : 1;
+    }
+    return left->isp < right->isp ? -1 : left->isp > right->isp;
+}
+
+#define profile_report_rows 20
+
+/*the rules with the most instructions of their own and the tests that fail most*/
+void profile_report(const Profile * self, const Program * program) {
+    const char ** const names = rule_names(program);
+    ProfileRank * const ranks = malloc(program->code_len * sizeof(ProfileRank));
+    long ranks_len = 0;
+    long i = 0;
+    if(ranks == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+
+    for(i = 0; i < program->code_len; ++i) {
+        if(self->rules[i].calls > 0) {
+            ranks[ranks_len].key = self->rules[i].self_instructions;
+            ranks[ranks_len].isp = i;
+            ++ranks_len;
+        }
+    }
+    qsort(ranks, ranks_len, sizeof(ProfileRank), profile_rank_compare);
+    fprintf(stderr, "profile rules=%ld nodes=%ld\n", ranks_len, self->nodes_len);
+    fprintf(stderr, "  %-16s %10s %10s %12s %12s %10s %10s\n",
+        "rule", "calls", "fails", "self_instr", "incl_instr", "self_ms", "incl_ms");
+    for(i = 0; i < ranks_len && i < profile_report_rows; ++i) {
+        const ProfileRule stats = self->rules[ranks[i].isp];
+        fprintf(stderr, "  %-16s %10ld %10ld %12ld %12ld %10.3f %10.3f\n",
+            names[ranks[i].isp] != NULL ? names[ranks[i].isp] : "?", stats.calls, stats.fails,
+            stats.self_instructions, stats.instructions, stats.self_seconds * 1e3, stats.seconds * 1e3);
+    }
+
+    ranks_len = 0;
+    for(i = 0; i < program->code_len; ++i) {
+        if(self->sites[i].fails > 0) {
+            ranks[ranks_len].key = self->sites[i].fails;
+            ranks[ranks_len].isp = i;
+            ++ranks_len;
+        }
+    }
+    qsort(ranks, ranks_len, sizeof(ProfileRank), profile_rank_compare);
+    fprintf(stderr, "  %-16s %6s %-13s %-16s %10s %10s %6s\n", "failing test in", "isp", "opcode", "operand", "runs", "fails", "fail%");
+    for(i = 0; i < ranks_len && i < profile_report_rows; ++i) {
+        const long isp = ranks[i].isp;
+        const Opcode op = program->code[isp];
+        const ProfileSite site = self->sites[isp];
+        long owner = isp;
+        /*the rule is the nearest call target or start at or before isp*/
+        while(owner > 0 && self->rules[owner].calls == 0) {
+            --owner;
+        }
+        fprintf(stderr, "  %-16s %6ld %-13s %-16.16s %10ld %10ld %6.1f\n",
+            names[owner] != NULL ? names[owner] : "?", isp, opcode_names[op.id],
+            opcode_has_string(op.id) ? &program->strings[op.arg] : "",
+            site.runs, site.fails, 100.0 * site.fails / site.runs);
+    }
+    free(ranks);
+    free((void *)names);
+}
+
+/*isp was just set to a return address; returning into a fused
+  call-and-branch takes its branch*/
+void vm_resume(Meta2Vm * self) {
+    if(self->isp != halt_address) {
+        const Opcode call = self->program->code[self->isp - 1];
+        if((call.id == opcode_cll_bt && self->switch_flag)
+            || (call.id == opcode_cll_bf && !self->switch_flag)) {
+            self->isp = call.arg2;
+        }
+    }
+}
+
+/*fails a call the FIRST set of its rule rules out*/
+int vm_predict_call(Meta2Vm * self, int target) {
+    const int set = self->program->rule_first[target];
+    if(set < 0) {
+        return 0;
+    }
+    vm_skip_whitespace(self);
+    if(charset_has(&self->program->first_sets[set], vm_peekch(self))) {
+        return 0;
+    }
+    self->switch_flag = 0;
+    ++self->predicted_calls;
+    return 1;
+}
+
+void vm_cll(Meta2Vm* self, int target) {
+    if(self->program != NULL && self->program->rule_first != NULL && vm_predict_call(self, target)) {
+        vm_resume(self);
+        return;
+    }
+    if(self->memo != NULL && memo_replay(self, target)) {
+        vm_resume(self);
+        return;
+    }
+    vm_push_frame(self, self->isp);
+    if(self->memo != NULL) {
+        memo_enter(self, self->stack_len - 1);
+    }
+    self->isp = target;
+}
+
+void vm_r(Meta2Vm * self) {
+    /*returning from the start rule's frame halts every engine*/
+    const int return_address = vm_pop_frame(self);
+    if(self->memo != NULL && self->stack_len > 0) {
+        /*the frame's rule is the target of the CLL just before the return address*/
+        memo_store(self, self->stack_len, self->program->code[return_address - 1].arg);
+    }
+    self->isp = return_address;
+    if(self->reparse != NULL && self->stack_len == 1) {
+        reparse_checkpoint(self);
+    }
+    if(self->chunk != NULL && self->stack_len == 1) {
+        chunk_checkpoint(self);
+    }
+}
+
+void vm_b(Meta2Vm * self, int target) {
+    self->isp = target;
+}
+
+
+void vm_bt(Meta2Vm * self, int target) {
+    if(self->switch_flag) {
+        self->isp = target;
+    }
+}
+
+
+void vm_bf(Meta2Vm * self, int target) {
+    if(!self->switch_flag) {
+        self->isp = target;
+    }
+}
+
+void vm_ci(Meta2Vm* self) {
+    if(self->memo != NULL && self->stack_len > 1
+        && self->memo->frames[self->stack_len - 1].token_serial == self->token_serial) {
+        /*copies a token scanned before the current call*/
+        ++self->effects;
+    }
+    vm_copy_token(self);
+}
+
+/*the only place label text goes into the output*/
+void vm_append_label(Meta2Vm * self, int label) {
+    if(self->chunk != NULL) {
+        chunk_label(self->chunk, label);
+    }
+    vm_write_label(self, label);
+}
+
+void vm_gn1(Meta2Vm * self) {
+    vm_append_label(self, vm_frame_label(self, 0));
+}
+
+void vm_gn2(Meta2Vm * self) {
+    vm_append_label(self, vm_frame_label(self, 1));
+}
+
+/*returns where the DISPATCH in front of head sends the next character*/
+int vm_dispatch(Meta2Vm * self, const int * table, int head) {
+    int target = 0;
+    vm_skip_whitespace(self);
+    target = table[(unsigned char)vm_peekch(self)];
+    if(target != head) {
+        /*every test skipped would have failed*/
+        self->switch_flag = 0;
+        ++self->predicted_jumps;
+    }
+    return target;
+}
+
+void vm_trace(const Meta2Vm * self, long isp) {
+    trace_record(isp, self->program->code[isp].id, vm_position(self), self->switch_flag);
+}
+
+void start_vm(Meta2Vm * self, const char * input, long input_len) {
+    assert(input != NULL);
+    assert(input_len >= 0);
+    assert(self->program != NULL);
+    self->input = input;
+    self->input_i = 0;
+    self->input_len = input_len;
+    self->input_offset = 0;
+    self->stack_len = 1;
+    self->switch_flag = 0;
+    self->token = 0;
+    self->token_len = 0;
+    self->instructions = 0;
+    self->calls = 0;
+
+    /*a vm may be reused, every parse starts from scratch*/
+    self->record.len = 0;
+    self->output_column = instruction_column;
+    self->label_counter = 0;
+
+    /*returning from the starting rule halts the vm*/
+    self->isp = self->program->start;
+    if(self->stack == NULL) {
+        vm_grow_stack(self);
+    }
+    self->stack[0].return_address = halt_address;
+    self->stack[0].label1 = -1;
+    self->stack[0].label2 = -1;
+}
+
+/*length of the string operand at isp; only the checked engine counts it*/
+ALWAYS_INLINE long operand_len(const Program * program, int isp, const int checked) {
+    return checked ? (long)strlen(&program->strings[program->code[isp].arg]) : program->literal_lens[isp];
+}
+
+/*reference engine: fetch an Opcode and switch on it. Inlined once per
+  value of checked, so the verified copy has no bounds check at all.*/
+ALWAYS_INLINE void vm_execute(Meta2Vm * self, const int checked) {
+    const Program * const program = self->program;
+    const Opcode * const code = program->code;
+    const char * const strings = program->strings;
+    const long code_len = program->code_len;
+    Profile * const profile = self->profile;
+    if(profile != NULL) {
+        profile_start(profile, self);
+    }
+
+    while(self->isp != halt_address) {
+        const int isp = self->isp;
+        Opcode op;
+        if(checked && (isp < 0 || isp >= code_len)) {
+            fatal_error(error_program, "Instruction %d is outside the program\n", isp);
+        }
+        op = code[isp];
+        if(trace_enabled(1)) {
+            vm_trace(self, self->isp);
+        }
+        if(profile != NULL) {
+            profile->isp = self->isp;
+            profile->depth = self->stack_len;
+        }
+        ++self->instructions;
+        ++self->isp;
+        switch(op.id) {
+            case opcode_tst: vm_tst(self, &strings[op.arg], operand_len(program, isp, checked)); break;
+            case opcode_id: vm_id(self); break;
+            case opcode_num: vm_num(self); break;
+            case opcode_sr: vm_sr(self); break;
+            case opcode_cll: vm_cll(self, op.arg); break;
+            case opcode_r: vm_r(self); vm_resume(self); break;
+            case opcode_set: vm_set(self); break;
+            case opcode_b: vm_b(self, op.arg); break;
+            case opcode_bt: vm_bt(self, op.arg); break;
+            case opcode_bf: vm_bf(self, op.arg); break;
+            case opcode_be: vm_be(self); break;
+            case opcode_cl: vm_cl(self, &strings[op.arg], operand_len(program, isp, checked)); break;
+            case opcode_ci: vm_ci(self); break;
+            case opcode_gn1: vm_gn1(self); break;
+            case opcode_gn2: vm_gn2(self); break;
+            case opcode_lb: vm_lb(self); break;
+            case opcode_out: vm_out(self); break;
+            case opcode_chr: vm_chr(self, &self->program->classes[vm_lexer(self->program, op)->classes]); break;
+            case opcode_tok: vm_tok(self, &self->program->classes[vm_lexer(self->program, op)->classes]); break;
+            case opcode_any: vm_any(self, self->program->trie, vm_lexer(self->program, op)->trie); break;
+            case opcode_tst_bf:
+                vm_tst(self, &strings[op.arg], operand_len(program, isp, checked));
+                vm_bf(self, op.arg2);
+                break;
+            case opcode_tst_be:
+                vm_tst(self, &strings[op.arg], operand_len(program, isp, checked));
+                vm_be(self);
+                break;
+            case opcode_cll_bt: vm_cll(self, op.arg); break;
+            case opcode_cll_bf: vm_cll(self, op.arg); break;
+            case opcode_cl_out:
+                vm_cl(self, &strings[op.arg], operand_len(program, isp, checked));
+                vm_out(self);
+                break;
+            case opcode_dispatch:
+                self->isp = vm_dispatch(self, &self->program->jump_tables[op.arg], self->isp);
+                break;
+            default:
+                fatal_error(error_program, "Invalid opcode %d at instruction %d\n", (int)op.id, self->isp - 1);
+        }
+        if(profile != NULL) {
+            profile_step(profile, self, op.id);
+        }
+    }
+}
+
+/*runs from the current state until the vm halts*/
+void continue_vm(Meta2Vm * self) {
+    if(self->program->verified) {
+        vm_execute(self, 0);
+    } else {
+        vm_execute(self, 1);
+    }
+}
+
+void run_vm(Meta2Vm* self, const char * input, long input_len) {
+    start_vm(self, input, input_len);
+    continue_vm(self);
+}
+
+/*parses input with the switch engine and records checkpoints. If the
+  last parse with reparse completed and input is its input with removed
+  bytes at start replaced by inserted ones, only the part around the edit
+  runs again; reparse->output is the whole output either way.*/
+void reparse_edit(Meta2Vm * self, Reparse * reparse, const char * input, long input_len,
+    long start, long removed, long inserted) {
+    const int valid = reparse->valid;
+    Buffer output = reparse->old_output;
+    long i = 0;
+    assert(self->memo == NULL && self->stream == NULL);
+    assert(start >= 0 && removed >= 0 && inserted >= 0 && start + inserted <= input_len);
+    reparse->valid = 0;
+
+    /*the last parse becomes the old one*/
+    free(reparse->old);
+    reparse->old = reparse->checkpoints;
+    reparse->old_len = valid ? reparse->checkpoints_len : 0;
+    reparse->old_next = 0;
+    reparse->checkpoints = NULL;
+    reparse->checkpoints_len = 0;
+    reparse->checkpoints_cap = 0;
+    reparse->old_output = reparse->output;
+    reparse->output = output;
+    reparse->output.len = 0;
+    reparse->edit_end = start + inserted;
+    reparse->delta = inserted - removed;
+    reparse->resumed = 0;
+    reparse->synced = -1;
+
+    start_vm(self, input, input_len);
+    self->output = reparse_write;
+    self->output_user = reparse;
+    self->reparse = reparse;
+    /*the bytes a checkpoint's parse looked at end lookahead after it*/
+    for(i = 0; i < reparse->old_len && reparse->old[i].position + reparse->lookahead <= start; ++i) {
+        reparse_push(reparse, &reparse->old[i]);
+    }
+    if(i > 0) {
+        const Checkpoint * const checkpoint = &reparse->old[i - 1];
+        restore_checkpoint(self, checkpoint);
+        buffer_append(&reparse->output, reparse->old_output.data, checkpoint->output);
+        reparse->old_next = i;
+        reparse->resumed = checkpoint->position;
+        vm_resume(self);
+    }
+    continue_vm(self);
+
+    if(reparse->synced < 0) {
+        reparse->switch_flag = self->switch_flag;
+    }
+    reparse->valid = 1;
+    self->reparse = NULL;
+    self->output = NULL;
+    self->output_user = NULL;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define HAVE_COMPUTED_GOTO 1
+#endif
+
+#ifdef HAVE_COMPUTED_GOTO
+
+/*pre-decoded instruction for the threaded engine: the handler address plus
+  an operand that is already a pointer, so dispatch is a single indirect jump*/
+typedef struct ThreadedOp {
+    const void * handler;
+    union {
+        const struct ThreadedOp * target;
+        const char * str;
+        const int * table;
+        const CharSet * classes;
+    } arg;
+    const struct ThreadedOp * target2; /*branch of TST_BF*/
+    long len; /*of str*/
+} ThreadedOp;
+
+/*direct threaded engine, same semantics as continue_vm*/
+void continue_vm_threaded(Meta2Vm * self) {
+    /*indexed by opcode id*/
+    static const void * const handlers[] = {
+        &&do_tst, &&do_id, &&do_num, &&do_sr, &&do_cll, &&do_r, &&do_set, &&do_b, &&do_bt,
+        &&do_bf, &&do_be, &&do_cl, &&do_ci, &&do_gn1, &&do_gn2, &&do_lb, &&do_out,
+        &&do_chr, &&do_tok, &&do_any, &&do_tst_bf, &&do_tst_be, &&do_cll, &&do_cll, &&do_cl_out, &&do_dispatch,
+    };
+    const Program * const program = self->program;
+    ThreadedOp * stream = self->threaded;
+    const ThreadedOp * ip = NULL;
+    long i = 0;
+    assert(ARRAY_LEN(handlers) == ARRAY_LEN(opcode_names));
+    if(!program->verified) {
+        continue_vm(self);
+        return;
+    }
+
+    if(stream == NULL) {
+        stream = self->threaded = malloc(program->code_len * sizeof(ThreadedOp));
+        if(stream == NULL) {
+            fatal_error(error_memory, "Out of memory\n");
+        }
+        for(i = 0; i < program->code_len; ++i) {
+            const Opcode op = program->code[i];
+            stream[i].handler = handlers[op.id];
+            if(opcode_has_label(op.id)) {
+                stream[i].arg.target = &stream[op.arg];
+            } else if(op.id == opcode_chr || op.id == opcode_tok) {
+                stream[i].arg.classes = &program->classes[vm_lexer(program, op)->classes];
+            } else if(op.id == opcode_any) {
+                /*the trie root*/
+                stream[i].arg.table = &vm_lexer(program, op)->trie;
+            } else if(opcode_has_string(op.id)) {
+                stream[i].arg.str = &program->strings[op.arg];
+            } else if(op.id == opcode_dispatch) {
+                stream[i].arg.table = &program->jump_tables[op.arg];
+            } else {
+                stream[i].arg.target = NULL;
+            }
+            stream[i].target2 = op.id == opcode_tst_bf ? &stream[op.arg2] : NULL;
+            stream[i].len = program->literal_lens[i];
+        }
+    }
+
+    if(self->isp == halt_address) {
+        return;
+    }
+    ip = &stream[self->isp];
+
+#define DISPATCH() \
+    do { \
+        if(trace_enabled(1)) { \
+            vm_trace(self, ip - stream); \
+        } \
+        ++self->instructions; \
+        goto *ip->handler; \
+    } while(0)
+
+    DISPATCH();
+
+do_tst: vm_tst(self, ip->arg.str, ip->len); ++ip; DISPATCH();
+do_id: vm_id(self); ++ip; DISPATCH();
+do_num: vm_num(self); ++ip; DISPATCH();
+do_sr: vm_sr(self); ++ip; DISPATCH();
+do_cll:
+    self->isp = ip + 1 - stream;
+    vm_cll(self, ip->arg.target - stream);
+    ip = &stream[self->isp];
+    DISPATCH();
+do_r:
+    vm_r(self);
+    if(self->isp == halt_address) {
+        return;
+    }
+    vm_resume(self);
+    ip = &stream[self->isp];
+    DISPATCH();
+do_set: vm_set(self); ++ip; DISPATCH();
+do_b: ip = ip->arg.target; DISPATCH();
+do_bt: ip = self->switch_flag ? ip->arg.target : ip + 1; DISPATCH();
+do_bf: ip = self->switch_flag ? ip + 1 : ip->arg.target; DISPATCH();
+do_be: vm_be(self); ++ip; DISPATCH();
+do_cl: vm_cl(self, ip->arg.str, ip->len); ++ip; DISPATCH();
+do_ci: vm_ci(self); ++ip; DISPATCH();
+do_gn1: vm_gn1(self); ++ip; DISPATCH();
+do_gn2: vm_gn2(self); ++ip; DISPATCH();
+do_lb: vm_lb(self); ++ip; DISPATCH();
+do_out: vm_out(self); ++ip; DISPATCH();
+do_chr: vm_chr(self, ip->arg.classes); ++ip; DISPATCH();
+do_tok: vm_tok(self, ip->arg.classes); ++ip; DISPATCH();
+do_any: vm_any(self, program->trie, *ip->arg.table); ++ip; DISPATCH();
+do_tst_bf:
+    vm_tst(self, ip->arg.str, ip->len);
+    ip = self->switch_flag ? ip + 1 : ip->target2;
+    DISPATCH();
+do_tst_be: vm_tst(self, ip->arg.str, ip->len); vm_be(self); ++ip; DISPATCH();
+do_cl_out: vm_cl(self, ip->arg.str, ip->len); vm_out(self); ++ip; DISPATCH();
+do_dispatch: ip = &stream[vm_dispatch(self, ip->arg.table, ip + 1 - stream)]; DISPATCH();
+
+#undef DISPATCH
+}
+
+#else
+
+void continue_vm_threaded(Meta2Vm * self) {
+    continue_vm(self);
+}
+
+#endif
+
+void run_vm_threaded(Meta2Vm * self, const char * input, long input_len) {
+    start_vm(self, input, input_len);
+    continue_vm_threaded(self);
+}
+
+#if defined(__x86_64__) && defined(__linux__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_JIT 1
+#endif
+
+#ifdef HAVE_JIT
+
+/*template jit for x86-64
+
+  Every opcode is copied out as a fixed machine code template into an
+  mmaped buffer. rbx holds the vm and r12d caches the switch, reloaded after
+  each helper that can change it. Branches become direct jumps and CLL/R
+  become native call/ret, so no dispatch is left. The stack stays 16 byte
+  aligned inside every rule because CLL reserves 8 bytes around the call.
+  Scanning and output call the vm_* helpers; R still pops the vm frame
+  that holds the GN1/GN2 labels.*/
+
+typedef struct {
+    long at;     /*offset of the rel32 to patch*/
+    int target;  /*isp it jumps to*/
+} JitFixup;
+
+typedef struct Jit {
+    unsigned char * code;
+    long len;
+    long cap;
+    long * offsets; /*code offset of each isp*/
+    const unsigned char ** addresses; /*address of each isp, for DISPATCH*/
+    JitFixup * fixups;
+    long fixups_len;
+    jmp_buf deep; /*where jit_cll leaves the machine code, see run_vm_jit*/
+} Jit;
+
+void jit_bytes(Jit * self, const char * bytes, long len) {
+    assert(self->len + len <= self->cap);
+    memcpy(&self->code[self->len], bytes, len);
+    self->len += len;
+}
+
+void jit_u32(Jit * self, unsigned int value) {
+    int i = 0;
+    assert(self->len + 4 <= self->cap);
+    for(i = 0; i < 4; ++i) {
+        self->code[self->len++] = (value >> (i * 8)) & 0xff;
+    }
+}
+
+void jit_u64(Jit * self, unsigned long value) {
+    jit_u32(self, value & 0xffffffffUL);
+    jit_u32(self, value >> 32);
+}
+
+/*emits the opcode bytes then a rel32 to isp, patched once all offsets are known*/
+void jit_jump(Jit * self, const char * opcode, long opcode_len, int target) {
+    jit_bytes(self, opcode, opcode_len);
+    self->fixups[self->fixups_len].at = self->len;
+    self->fixups[self->fixups_len].target = target;
+    ++self->fixups_len;
+    jit_u32(self, 0);
+}
+
+#define jit_emit(self, literal) jit_bytes(self, literal, sizeof(literal) - 1)
+
+/*call fn(vm, ...) with any extra arguments already in esi/rsi and rdx*/
+void jit_call(Jit * self, unsigned long fn) {
+    jit_emit(self, "\x48\x89\xdf");          /*mov rdi, rbx*/
+    jit_emit(self, "\x48\xb8");              /*mov rax, fn*/
+    jit_u64(self, fn);
+    jit_emit(self, "\xff\xd0");              /*call rax*/
+}
+
+void jit_load_switch(Jit * self) {
+    jit_emit(self, "\x44\x8b\xa3");          /*mov r12d, [rbx + switch_flag]*/
+    jit_u32(self, offsetof(Meta2Vm, switch_flag));
+}
+
+void jit_string_args(Jit * self, const char * str) {
+    jit_emit(self, "\x48\xbe");              /*mov rsi, str*/
+    jit_u64(self, (unsigned long)str);
+    jit_emit(self, "\xba");                  /*mov edx, strlen(str)*/
+    jit_u32(self, strlen(str));
+}
+
+/*every nested call takes 16 bytes of machine stack, keep well inside
+  the smallest thread stack the vm runs on; deeper calls go on in the
+  threaded engine, whose frames are all on the vm stack*/
+#define jit_depth_cap (1 << 16)
+
+/*returns 0 when the memo answered the call, otherwise the frame is pushed*/
+int jit_cll(Meta2Vm * self, int return_isp, int target) {
+    const long depth = self->stack_len;
+    self->isp = return_isp;
+    vm_cll(self, target);
+    if(self->stack_len > jit_depth_cap) {
+        /*the vm stack holds every return address the machine stack does*/
+        continue_vm_threaded(self);
+        longjmp(self->jit->deep, 1);
+    }
+    return self->stack_len > depth;
+}
+
+/*machine code for one base opcode*/
+void jit_template(Jit * self, const Program * program, Opcode op, int isp) {
+    const char * const str = &program->strings[op.arg];
+    switch(op.id) {
+        case opcode_tst:
+            jit_string_args(self, str);
+            jit_call(self, (unsigned long)vm_tst);
+            jit_load_switch(self);
+            break;
+        case opcode_id: jit_call(self, (unsigned long)vm_id); jit_load_switch(self); break;
+        case opcode_num: jit_call(self, (unsigned long)vm_num); jit_load_switch(self); break;
+        case opcode_sr: jit_call(self, (unsigned long)vm_sr); jit_load_switch(self); break;
+        case opcode_cll:
+            jit_emit(self, "\xbe");          /*mov esi, isp + 1*/
+            jit_u32(self, isp + 1);
+            jit_emit(self, "\xba");          /*mov edx, target*/
+            jit_u32(self, op.arg);
+            jit_call(self, (unsigned long)jit_cll);
+            jit_emit(self, "\x85\xc0");      /*test eax, eax*/
+            jit_emit(self, "\x74\x0d");      /*jz over the call*/
+            jit_emit(self, "\x48\x83\xec\x08"); /*sub rsp, 8*/
+            jit_jump(self, "\xe8", 1, op.arg);  /*call target*/
+            jit_emit(self, "\x48\x83\xc4\x08"); /*add rsp, 8*/
+            jit_load_switch(self);
+            break;
+        case opcode_r:
+            jit_call(self, (unsigned long)vm_r);
+            jit_emit(self, "\xc3");          /*ret*/
+            break;
+        case opcode_set:
+            jit_emit(self, "\x41\xbc\x01\x00\x00\x00"); /*mov r12d, 1*/
+            jit_emit(self, "\xc7\x83");      /*mov dword [rbx + switch_flag], 1*/
+            jit_u32(self, offsetof(Meta2Vm, switch_flag));
+            jit_u32(self, 1);
+            break;
+        case opcode_b: jit_jump(self, "\xe9", 1, op.arg); break;
+        case opcode_bt:
+            jit_emit(self, "\x45\x85\xe4");  /*test r12d, r12d*/
+            jit_jump(self, "\x0f\x85", 2, op.arg); /*jnz target*/
+            break;
+        case opcode_bf:
+            jit_emit(self, "\x45\x85\xe4");
+            jit_jump(self, "\x0f\x84", 2, op.arg); /*jz target*/
+            break;
+        case opcode_be:
+            jit_emit(self, "\x45\x85\xe4");
+            jit_emit(self, "\x75\x0f");      /*jnz over the call*/
+            jit_call(self, (unsigned long)vm_be);
+            break;
+        case opcode_cl:
+            jit_string_args(self, str);
+            jit_call(self, (unsigned long)vm_cl);
+            break;
+        case opcode_ci: jit_call(self, (unsigned long)vm_ci); break;
+        case opcode_gn1: jit_call(self, (unsigned long)vm_gn1); break;
+        case opcode_gn2: jit_call(self, (unsigned long)vm_gn2); break;
+        case opcode_lb: jit_call(self, (unsigned long)vm_lb); break;
+        case opcode_out: jit_call(self, (unsigned long)vm_out); break;
+        case opcode_chr:
+        case opcode_tok:
+            jit_emit(self, "\x48\xbe");      /*mov rsi, classes*/
+            jit_u64(self, (unsigned long)&program->classes[vm_lexer(program, op)->classes]);
+            jit_call(self, op.id == opcode_chr ? (unsigned long)vm_chr : (unsigned long)vm_tok);
+            jit_load_switch(self);
+            break;
+        case opcode_any:
+            jit_emit(self, "\x48\xbe");      /*mov rsi, trie*/
+            jit_u64(self, (unsigned long)program->trie);
+            jit_emit(self, "\xba");          /*mov edx, root*/
+            jit_u32(self, vm_lexer(program, op)->trie);
+            jit_call(self, (unsigned long)vm_any);
+            jit_load_switch(self);
+            break;
+        case opcode_dispatch:
+            jit_emit(self, "\x48\xbe");      /*mov rsi, table*/
+            jit_u64(self, (unsigned long)&program->jump_tables[op.arg]);
+            jit_emit(self, "\xba");          /*mov edx, isp + 1*/
+            jit_u32(self, isp + 1);
+            jit_call(self, (unsigned long)vm_dispatch);
+            jit_load_switch(self);
+            /*an int return leaves the upper half of rax undefined*/
+            jit_emit(self, "\x89\xc0");      /*mov eax, eax*/
+            jit_emit(self, "\x48\xb9");      /*mov rcx, addresses*/
+            jit_u64(self, (unsigned long)self->addresses);
+            jit_emit(self, "\xff\x24\xc1");  /*jmp [rcx + rax * 8]*/
+            break;
+        default:
+            /*invalid opcode*/
+            abort();
+    }
+}
+
+/*superinstructions are their two halves back to back*/
+void jit_opcode(Jit * self, const Program * program, int isp) {
+    const Opcode op = program->code[isp];
+    Opcode first = op;
+    Opcode second = op;
+    jit_emit(self, "\x48\xff\x83");          /*inc qword [rbx + instructions]*/
+    jit_u32(self, offsetof(Meta2Vm, instructions));
+    switch(op.id) {
+        case opcode_tst_bf: first.id = opcode_tst; second.id = opcode_bf; break;
+        case opcode_tst_be: first.id = opcode_tst; second.id = opcode_be; break;
+        case opcode_cll_bt: first.id = opcode_cll; second.id = opcode_bt; break;
+        case opcode_cll_bf: first.id = opcode_cll; second.id = opcode_bf; break;
+        case opcode_cl_out: first.id = opcode_cl; second.id = opcode_out; break;
+        default:
+            jit_template(self, program, op, isp);
+            return;
+    }
+    second.arg = op.arg2;
+    jit_template(self, program, first, isp);
+    jit_template(self, program, second, isp);
+}
+
+/*the longest opcode is CLL_BT/CLL_BF*/
+#define jit_opcode_cap 96
+
+typedef void (*JitEntry)(Meta2Vm * self);
+
+void jit_free(Jit * self) {
+    munmap(self->code, self->cap);
+    free(self->offsets);
+    free((void *)self->addresses);
+    free(self->fixups);
+    memset(self, 0, sizeof(Jit));
+}
+
+/*returns NULL if the buffer can not be mapped executable*/
+JitEntry jit_compile(const Program * program, Jit * self) {
+    long i = 0;
+    memset(self, 0, sizeof(Jit));
+    self->cap = (program->code_len + 1) * jit_opcode_cap;
+    self->code = mmap(NULL, self->cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(self->code == MAP_FAILED) {
+        return NULL;
+    }
+    self->offsets = malloc(program->code_len * sizeof(long));
+    self->addresses = malloc(program->code_len * sizeof(unsigned char *));
+    self->fixups = malloc((program->code_len + 1) * sizeof(JitFixup));
+    if(self->offsets == NULL || self->addresses == NULL || self->fixups == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+
+    /*entry: save registers, call the start rule, restore*/
+    jit_emit(self, "\x53\x41\x54\x41\x55"); /*push rbx; push r12; push r13*/
+    jit_emit(self, "\x48\x89\xfb");          /*mov rbx, rdi*/
+    jit_load_switch(self);
+    jit_emit(self, "\x48\x83\xec\x08");      /*sub rsp, 8*/
+    jit_jump(self, "\xe8", 1, program->start);
+    jit_emit(self, "\x48\x83\xc4\x08");      /*add rsp, 8*/
+    jit_emit(self, "\x41\x5d\x41\x5c\x5b\xc3"); /*pop r13; pop r12; pop rbx; ret*/
+
+    for(i = 0; i < program->code_len; ++i) {
+        self->offsets[i] = self->len;
+        jit_opcode(self, program, i);
+    }
+    for(i = 0; i < program->code_len; ++i) {
+        self->addresses[i] = &self->code[self->offsets[i]];
+    }
+    for(i = 0; i < self->fixups_len; ++i) {
+        const JitFixup fixup = self->fixups[i];
+        const long rel = self->offsets[fixup.target] - (fixup.at + 4);
+        const long end = self->len;
+        self->len = fixup.at;
+        jit_u32(self, (unsigned int)rel);
+        self->len = end;
+    }
+    if(mprotect(self->code, self->cap, PROT_READ | PROT_EXEC) != 0) {
+        jit_free(self);
+        return NULL;
+    }
+    return (JitEntry)(void *)self->code;
+}
+
+/*native engine; falls back to the threaded one when tracing or when no
+  executable memory can be had, and finishes a parse in it once calls nest
+  deeper than jit_depth_cap*/
+void run_vm_jit(Meta2Vm * self, const char * input, long input_len) {
+    if(trace_enabled(1) || !self->program->verified) {
+        run_vm_threaded(self, input, input_len);
+        return;
+    }
+    if(self->jit == NULL) {
+        Jit * const jit = calloc(1, sizeof(Jit));
+        if(jit == NULL) {
+            fatal_error(error_memory, "Out of memory\n");
+        }
+        self->jit = jit; /*so free_vm releases it if compiling runs out of memory*/
+        if(jit_compile(self->program, jit) == NULL) {
+            self->jit = NULL;
+            free(jit);
+            run_vm_threaded(self, input, input_len);
+            return;
+        }
+    }
+    start_vm(self, input, input_len);
+    if(setjmp(self->jit->deep) == 0) {
+        ((JitEntry)(void *)self->jit->code)(self);
+    }
+    assert(self->stack_len == 0);
+}
+
+#else
+
+void run_vm_jit(Meta2Vm * self, const char * input, long input_len) {
+    run_vm_threaded(self, input, input_len);
+}
+
+#endif
+
+/*frees what runs left in the vm, not its program, memo or sink*/
+void free_vm(Meta2Vm * self) {
+#ifdef HAVE_JIT
+    if(self->jit != NULL) {
+        jit_free(self->jit);
+        free(self->jit);
+    }
+#endif
+    free(self->threaded);
+    self->threaded = NULL;
+    self->jit = NULL;
+    vm_release(self);
+}
+
+/*metac.c builds the rest of this file into the library*/
+#ifndef VM_RUNTIME
+
+void usage(void) {
+    fprintf(stderr,
+        "usage: vm [-SsmOpd] [-t level] [-e engine] [-o file] [-P file] program input\n"
+        "       vm [-sOpd] [-t level] [-o file] -R old program input\n"
+        "       vm [-SsmOpd] [-e engine] -B dir [-j jobs] program input...\n"
+        "       vm [-sOp] [-e engine] [-o file] -j jobs program input\n"
+        "       vm -a image program\n"
+        "\n"
+        "program is META II assembly text or a bytecode image; input - is stdin\n"
+        "  -a image   assemble program into a bytecode image and exit\n"
+        "  -e engine  'threaded' (default), 'switch' or 'jit' (x86-64 Linux)\n"
+        "  -o file    write the output to file instead of stdout\n"
+        "  -B dir     batch mode: write the output for each input to dir/<input>.out\n"
+        "  -j jobs    worker threads for batch mode, one per cpu by default; with\n"
+        "             one input, parse it in up to jobs pieces split where top\n"
+        "             level statements end, or on one thread if they do not join\n"
+        "  -S         read regular files in chunks like pipes instead of mapping them\n"
+        "  -s         print instruction count and speed to stderr\n"
+        "  -m         memoize rule calls (packrat mode), -s reports hits\n"
+        "  -O         inline small rules and run the peephole optimizer, -s reports\n"
+        "             what it did and the calls still executed\n"
+        "  -p         predict alternatives and calls from FIRST sets\n"
+        "  -t level   trace level: 1 records instructions, 2 also prints them\n"
+        "  -d         dump the last traced instructions to stderr at exit\n"
+        "  -P file    profile rules and tests on the switch engine, print a summary\n"
+        "             to stderr and write folded stacks for flamegraphs to file\n"
+        "  -R old     parse old, then input as an edit of it, running again only\n"
+        "             from the statement before the change until the parse rejoins\n");
+    exit(2);
+}
+
+void load_program(const char * filename, Program * program) {
+    long len = 0;
+    const char * text = map_file(filename, &len);
+    if(is_image(text, len)) {
+        load_image(text, len, filename, program);
+    } else {
+        /*operands are interned, so the text is not needed after loading*/
+        assemble_program(text, len, program);
+        unmap_file(text, len);
+    }
+}
+
+void check_verified(Program * program) {
+    if(!verify_program(program)) {
+        fprintf(stderr, "Warning: the program failed verification, running it on the checked switch engine\n");
+    }
+}
+
+int valid_engine(const char * engine) {
+    return strcmp(engine, "threaded") == 0 || strcmp(engine, "switch") == 0 || strcmp(engine, "jit") == 0;
+}
+
+void run_input_close(Meta2Vm * vm, Sink * sink, Stream * input_stream, const char * input, long input_len) {
+    vm->sink = NULL;
+    free(sink);
+    if(vm->stream != NULL) {
+        vm->stream = NULL;
+        stream_close(input_stream);
+    } else {
+        unmap_file(input, input_len);
+    }
+}
+
+/*runs the engine over an opened input; a caller that handles errors
+  gets the input and sink released before the error is passed on*/
+double run_input_engine(Meta2Vm * vm, const char * engine, Sink * sink, Stream * input_stream, const char * input, long input_len) {
+    ErrorHandler handler;
+    ErrorHandler * const outer = error_handler;
+    double elapsed = 0;
+    if(outer != NULL) {
+        error_handler = &handler;
+        if(setjmp(handler.jump) != 0) {
+            error_handler = outer;
+            run_input_close(vm, sink, input_stream, input, input_len);
+            fatal_error(handler.code, "%s", handler.message);
+        }
+    }
+    elapsed = seconds_now();
+    if(strcmp(engine, "threaded") == 0) {
+        run_vm_threaded(vm, input, input_len);
+    } else if(strcmp(engine, "switch") == 0) {
+        run_vm(vm, input, input_len);
+    } else {
+        run_vm_jit(vm, input, input_len);
+    }
+    sink_flush(sink);
+    elapsed = seconds_now() - elapsed;
+    error_handler = outer;
+    run_input_close(vm, sink, input_stream, input, input_len);
+    return elapsed;
+}
+
+/*parses one input file with vm->program and writes the output to fd;
+  returns the seconds spent in the engine. Pipes, stdin and, with stream
+  set, regular files are read in chunks rather than mapped.*/
+double run_input(Meta2Vm * vm, const char * engine, const char * input_file, int stream, int fd) {
+    Stream input_stream;
+    long input_len = 0;
+    const char * input = NULL;
+    Sink * const sink = malloc(sizeof(Sink));
+    double elapsed = 0;
+    if(sink == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+    stream = stream_open(&input_stream, input_file, stream);
+    if(stream) {
+        /*the first test refills*/
+        vm->stream = &input_stream;
+        input = "";
+    } else {
+        input = map_file(input_file, &input_len);
+    }
+    sink_init(sink, fd);
+    vm->sink = sink;
+
+    elapsed = run_input_engine(vm, engine, sink, &input_stream, input, input_len);
+    free_vm(vm);
+    return elapsed;
+}
+
+/*-R: parses old_file, then input_file as an edit of it, and writes the
+  second output to fd; returns the seconds spent on the second parse*/
+double run_reparse(Meta2Vm * vm, const char * old_file, const char * input_file, int stats, int fd) {
+    long old_len = 0;
+    long input_len = 0;
+    const char * const old = map_file(old_file, &old_len);
+    const char * const input = map_file(input_file, &input_len);
+    Reparse reparse;
+    Sink * const sink = malloc(sizeof(Sink));
+    long prefix = 0;
+    long suffix = 0;
+    double elapsed = 0;
+    if(sink == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+    reparse_init(&reparse, vm->program);
+    reparse_edit(vm, &reparse, old, old_len, 0, 0, old_len);
+    if(stats) {
+        fprintf(stderr, "reparse full instructions=%ld\n", vm->instructions);
+    }
+
+    /*the edit is what lies between the common prefix and suffix*/
+    for(; prefix < old_len && prefix < input_len && old[prefix] == input[prefix]; ++prefix);
+    for(; suffix < old_len - prefix && suffix < input_len - prefix
+        && old[old_len - 1 - suffix] == input[input_len - 1 - suffix]; ++suffix);
+    elapsed = seconds_now();
+    reparse_edit(vm, &reparse, input, input_len, prefix, old_len - prefix - suffix, input_len - prefix - suffix);
+    elapsed = seconds_now() - elapsed;
+    if(stats) {
+        fprintf(stderr, "reparse edit=%ld+%ld-%ld resumed=%ld synced=%ld\n",
+            prefix, input_len - prefix - suffix, old_len - prefix - suffix, reparse.resumed, reparse.synced);
+    }
+
+    sink_init(sink, fd);
+    sink_write(sink, reparse.output.data, reparse.output.len);
+    sink_flush(sink);
+    free(sink);
+    reparse_free(&reparse);
+    free_vm(vm);
+    unmap_file(input, input_len);
+    unmap_file(old, old_len);
+    return elapsed;
+}
+
+/*-j on one input: the pieces are at least this long; make check-split
+  builds with a tiny SPLIT_MIN so that small inputs split too*/
+#ifndef SPLIT_MIN
+#define SPLIT_MIN (64 * 1024)
+#endif
+#define split_min SPLIT_MIN
+
+/*finds the start rule's $ loop over a statement rule, CLL rule; BT back
+  to the call, and the literal the statement rule tests last, such as
+  ".," for META II. Returns the loop's return address, or -1 when the
+  start rule has no such loop.*/
+int split_grammar(const Program * program, const char ** terminator) {
+    const Opcode * const code = program->code;
+    int loop = -1;
+    int i = 0;
+    for(i = program->start; i < program->code_len && code[i].id != opcode_r && loop < 0; ++i) {
+        if((code[i].id == opcode_cll && i + 1 < program->code_len
+                && code[i + 1].id == opcode_bt && code[i + 1].arg == i)
+            || (code[i].id == opcode_cll_bt && code[i].arg2 == i)) {
+            loop = i;
+        }
+    }
+    if(loop < 0) {
+        return -1;
+    }
+    *terminator = NULL;
+    for(i = code[loop].arg; i < program->code_len && code[i].id != opcode_r; ++i) {
+        if(code[i].id == opcode_tst || code[i].id == opcode_tst_bf || code[i].id == opcode_tst_be) {
+            *terminator = &program->strings[code[i].arg];
+        }
+    }
+    return *terminator != NULL ? loop + 1 : -1;
+}
+
+/*the first occurrence of literal in [from, end), or NULL*/
+const char * find_literal(const char * from, const char * end, const char * literal, long len) {
+    while(end - from >= len) {
+        from = memchr(from, literal[0], end - from - len + 1);
+        if(from == NULL || memcmp(from, literal, len) == 0) {
+            return from;
+        }
+        ++from;
+    }
+    return NULL;
+}
+
+/*the end of the first terminator from from on that whitespace follows,
+  where a statement most likely ends; -1 if there is none*/
+long split_point(const char * input, long input_len, long from, const char * terminator) {
+    const long len = strlen(terminator);
+    const char * found = &input[from];
+    while((found = find_literal(found, input + input_len, terminator, len)) != NULL) {
+        if(found + len < input + input_len && char_is(found[len], class_space)) {
+            return found + len - input;
+        }
+        ++found;
+    }
+    return -1;
+}
+
+typedef struct {
+    Chunk * chunk;
+    const char * engine;
+    const char * input;
+    long input_len;
+    int resume;
+} SplitJob;
+
+void split_parse(SplitJob * self) {
+    Chunk * const chunk = self->chunk;
+    Meta2Vm * const vm = &chunk->vm;
+    vm->chunk = chunk;
+    vm->output = chunk_write;
+    vm->output_user = chunk;
+    start_vm(vm, self->input, self->input_len);
+    if(chunk->start > 0) {
+        Checkpoint guess;
+        memset(&guess, 0, sizeof(guess));
+        guess.position = chunk->start;
+        guess.isp = self->resume;
+        guess.switch_flag = 1;
+        guess.output_column = instruction_column;
+        guess.label1 = -1;
+        guess.label2 = -1;
+        chunk_push(chunk, &guess);
+        restore_checkpoint(vm, &guess);
+        vm_resume(vm);
+    }
+    if(strcmp(self->engine, "switch") == 0) {
+        continue_vm(vm);
+    } else {
+        continue_vm_threaded(vm);
+    }
+}
+
+void * split_worker(void * arg) {
+    SplitJob * const self = arg;
+    ErrorHandler handler;
+    error_handler = &handler;
+    if(setjmp(handler.jump) != 0) {
+        /*the serial parse reports it, if it is real*/
+        self->chunk->failed = 1;
+    } else {
+        split_parse(self);
+    }
+    error_handler = NULL;
+    return NULL;
+}
+
+/*the checkpoint of next equal to last, in which labels are numbered
+  from a different start; NULL if there is none*/
+const Checkpoint * split_meet(const Chunk * next, const Checkpoint * last) {
+    long i = 0;
+    for(i = 0; i < next->checkpoints_len && next->checkpoints[i].position <= last->position; ++i) {
+        const Checkpoint * const checkpoint = &next->checkpoints[i];
+        const long offset = last->label_counter - checkpoint->label_counter;
+        if(checkpoint->position == last->position && checkpoint->isp == last->isp
+            && checkpoint->switch_flag == last->switch_flag
+            && checkpoint->output_column == last->output_column
+            && checkpoint->token == last->token && checkpoint->token_len == last->token_len
+            && (checkpoint->label1 < 0 ? last->label1 < 0 : checkpoint->label1 + offset == last->label1)
+            && (checkpoint->label2 < 0 ? last->label2 < 0 : checkpoint->label2 + offset == last->label2)) {
+            return checkpoint;
+        }
+    }
+    return NULL;
+}
+
+/*writes the output of chunk in [from, to) with offset added to its labels*/
+void split_write(Sink * sink, const Chunk * chunk, long from, long to, long offset) {
+    char text[str_cap];
+    long i = 0;
+    for(i = 0; i < chunk->sites_written && chunk->sites[i].output < from; ++i);
+    for(; i < chunk->sites_written && chunk->sites[i].output < to; ++i) {
+        const LabelSite * const site = &chunk->sites[i];
+        const long len = &text[str_cap] - label_text(site->label, &text[str_cap]);
+        const char * const start = label_text(site->label + offset, &text[str_cap]);
+        sink_write(sink, &chunk->output.data[from], site->output - from);
+        sink_write(sink, start, &text[str_cap] - start);
+        from = site->output + len;
+    }
+    sink_write(sink, &chunk->output.data[from], to - from);
+}
+
+void chunk_free(Chunk * self) {
+    free_vm(&self->vm);
+    free(self->checkpoints);
+    free(self->sites);
+    buffer_free(&self->output);
+}
+
+/*-j on one input: cuts it after the statement rule's last literal about
+  every 1/jobs of the way, parses the pieces on their own threads and
+  writes the joined output to fd. If the grammar has no top level loop,
+  a piece fails or two pieces do not join, the input is parsed again on
+  one thread with run_input. Returns the seconds spent on both.*/
+double run_split(Meta2Vm * vm, const char * engine, const char * input_file, long jobs, int stats, int fd) {
+    const char * terminator = NULL;
+    const int resume = split_grammar(vm->program, &terminator);
+    long input_len = 0;
+    const char * const input = map_file(input_file, &input_len);
+    Chunk * chunks = NULL;
+    SplitJob * split_jobs = NULL;
+    pthread_t * threads = NULL;
+    long chunks_len = 1;
+    long i = 0;
+    int joined = resume >= 0;
+    double elapsed = seconds_now();
+
+    if(jobs > input_len / split_min) {
+        jobs = input_len / split_min;
+    }
+    chunks = calloc(jobs > 1 ? jobs : 1, sizeof(Chunk));
+    split_jobs = calloc(jobs > 1 ? jobs : 1, sizeof(SplitJob));
+    threads = malloc((jobs > 1 ? jobs : 1) * sizeof(pthread_t));
+    if(chunks == NULL || split_jobs == NULL || threads == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+    for(i = 1; joined && i < jobs; ++i) {
+        const long from = input_len / jobs * i;
+        const long after = chunks[chunks_len - 1].start + 1;
+        const long start = split_point(input, input_len, from > after ? from : after, terminator);
+        if(start > 0) {
+            chunks[chunks_len++].start = start;
+        }
+    }
+    joined = joined && chunks_len > 1;
+
+    if(joined) {
+        for(i = 0; i < chunks_len; ++i) {
+            chunks[i].vm.program = vm->program;
+            chunks[i].stop = i + 1 < chunks_len ? chunks[i + 1].start : -1;
+            split_jobs[i].chunk = &chunks[i];
+            split_jobs[i].engine = engine;
+            split_jobs[i].input = input;
+            split_jobs[i].input_len = input_len;
+            split_jobs[i].resume = resume;
+            if(pthread_create(&threads[i], NULL, split_worker, &split_jobs[i]) != 0) {
+                fatal_error(error_memory, "Failed to start worker thread\n");
+            }
+        }
+        for(i = 0; i < chunks_len; ++i) {
+            pthread_join(threads[i], NULL);
+            joined = joined && !chunks[i].failed && (chunks[i].stopped || i + 1 == chunks_len);
+        }
+    }
+
+    if(joined) {
+        /*where each piece's output starts and what its labels are off by*/
+        const Checkpoint ** const meets = calloc(chunks_len, sizeof(Checkpoint *));
+        long * const offsets = calloc(chunks_len, sizeof(long));
+        Sink * const sink = malloc(sizeof(Sink));
+        if(meets == NULL || offsets == NULL || sink == NULL) {
+            fatal_error(error_memory, "Out of memory\n");
+        }
+        for(i = 1; joined && i < chunks_len; ++i) {
+            const Chunk * const last = &chunks[i - 1];
+            Checkpoint stop = last->checkpoints[last->checkpoints_len - 1];
+            stop.label_counter += offsets[i - 1];
+            stop.label1 += stop.label1 < 0 ? 0 : offsets[i - 1];
+            stop.label2 += stop.label2 < 0 ? 0 : offsets[i - 1];
+            meets[i] = split_meet(&chunks[i], &stop);
+            joined = meets[i] != NULL;
+            offsets[i] = joined ? stop.label_counter - meets[i]->label_counter : 0;
+        }
+        if(joined) {
+            sink_init(sink, fd);
+            for(i = 0; i < chunks_len; ++i) {
+                const Chunk * const chunk = &chunks[i];
+                split_write(sink, chunk, i > 0 ? meets[i]->output : 0,
+                    i + 1 < chunks_len ? chunk->checkpoints[chunk->checkpoints_len - 1].output : chunk->output.len,
+                    offsets[i]);
+            }
+            sink_flush(sink);
+        }
+        free(sink);
+        free(offsets);
+        free((void *)meets);
+    }
+    elapsed = seconds_now() - elapsed;
+    if(stats) {
+        fprintf(stderr, "split pieces=%ld terminator=%s joined=%d\n",
+            chunks_len, terminator != NULL ? terminator : "none", joined);
+    }
+
+    vm->instructions = 0;
+    vm->calls = 0;
+    for(i = 0; i < chunks_len; ++i) {
+        vm->instructions += chunks[i].vm.instructions;
+        vm->calls += chunks[i].vm.calls;
+        chunk_free(&chunks[i]);
+    }
+    vm->switch_flag = chunks[chunks_len - 1].vm.switch_flag;
+    vm->input_offset = 0;
+    vm->input_len = input_len;
+    free(threads);
+    free(split_jobs);
+    free(chunks);
+    unmap_file(input, input_len);
+    if(!joined) {
+        elapsed += run_input(vm, engine, input_file, 0, fd);
+    }
+    return elapsed;
+}
+
+/*batch mode: a pool of threads shares one read-only program and takes
+  input files off a list; every run has its own vm, memo and output*/
+
+typedef struct {
+    long instructions;
+    long calls;
+    long bytes;
+    double seconds;
+    int failed;
+} BatchResult;
+
+typedef struct {
+    const Program * program;
+    const char * engine;
+    int memoize;
+    int stream;
+    const char * output_dir;
+    char ** inputs;
+    long inputs_len;
+    BatchResult * results;
+
+    pthread_mutex_t lock;
+    long next; /*next input to take, under lock*/
+} Batch;
+
+char * batch_output_path(const char * output_dir, const char * input_file) {
+    const char * const slash = strrchr(input_file, '/');
+    const char * const name = slash == NULL ? input_file : slash + 1;
+    const long len = strlen(output_dir) + strlen(name) + sizeof("/.out");
+    char * const path = malloc(len);
+    if(path == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+    snprintf(path, len, "%s/%s.out", output_dir, name);
+    return path;
+}
+
+/*one input of a batch, held here so that a run an error stopped can
+  still be cleaned up*/
+typedef struct {
+    long index;
+    Meta2Vm vm;
+    Memo memo;
+    char * path;
+    int fd;
+} BatchJob;
+
+void batch_job(Batch * self, BatchJob * job) {
+    BatchResult * const result = &self->results[job->index];
+    job->vm.program = self->program;
+    if(self->memoize) {
+        memo_init(&job->memo, self->program);
+        job->vm.memo = &job->memo;
+    }
+    job->path = batch_output_path(self->output_dir, self->inputs[job->index]);
+    job->fd = open_output(job->path);
+    result->seconds = run_input(&job->vm, self->engine, self->inputs[job->index], self->stream, job->fd);
+    result->instructions = job->vm.instructions;
+    result->calls = job->vm.calls;
+    result->bytes = job->vm.input_offset + job->vm.input_len;
+}
+
+void batch_job_free(BatchJob * job) {
+    if(job->fd >= 0) {
+        close(job->fd);
+    }
+    free(job->path);
+    free_vm(&job->vm);
+    if(job->vm.memo != NULL) {
+        memo_free(&job->memo);
+    }
+}
+
+/*an input that fails is reported and loses its output, the rest of the
+  batch goes on*/
+void * batch_worker(void * arg) {
+    Batch * const self = arg;
+    BatchJob * const job = malloc(sizeof(BatchJob));
+    ErrorHandler handler;
+    if(job == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+    for(;;) {
+        memset(job, 0, sizeof(BatchJob));
+        job->fd = -1;
+        pthread_mutex_lock(&self->lock);
+        job->index = self->next++;
+        pthread_mutex_unlock(&self->lock);
+        if(job->index >= self->inputs_len) {
+            break;
+        }
+
+        error_handler = &handler;
+        if(setjmp(handler.jump) != 0) {
+            self->results[job->index].failed = 1;
+            fprintf(stderr, "%s: Error: %s", self->inputs[job->index], handler.message);
+            if(job->path != NULL) {
+                unlink(job->path);
+            }
+        } else {
+            batch_job(self, job);
+        }
+        error_handler = NULL;
+        batch_job_free(job);
+    }
+    free(job);
+    return NULL;
+}
+
+void run_batch(Batch * self, long jobs) {
+    pthread_t * const threads = malloc(jobs * sizeof(pthread_t));
+    long i = 0;
+    if(threads == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+    pthread_mutex_init(&self->lock, NULL);
+    self->next = 0;
+    for(i = 0; i < jobs; ++i) {
+        if(pthread_create(&threads[i], NULL, batch_worker, self) != 0) {
+            fatal_error(error_memory, "Failed to start worker thread\n");
+        }
+    }
+    for(i = 0; i < jobs; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&self->lock);
+    free(threads);
+}
+
+int main(int argc, char** argv) {
+    const char * image_file = NULL;
+    const char * engine = "threaded";
+    const char * output_file = NULL;
+    const char * output_dir = NULL;
+    const char * profile_file = NULL;
+    const char * reparse_file = NULL;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int split = 0;
+    int stream = 0;
+    int stats = 0;
+    int memoize = 0;
+    int optimize = 0;
+    int predict = 0;
+    int dump = 0;
+    int status = 0;
+    int opt = 0;
+    while((opt = getopt(argc, argv, "a:e:o:B:j:P:R:SsmOpt:d")) != -1) {
+        switch(opt) {
+            case 'a': image_file = optarg; break;
+            case 'e': engine = optarg; break;
+            case 'o': output_file = optarg; break;
+            case 'B': output_dir = optarg; break;
+            case 'j': jobs = atol(optarg); split = 1; break;
+            case 'P': profile_file = optarg; break;
+            case 'R': reparse_file = optarg; break;
+            case 'S': stream = 1; break;
+            case 's': stats = 1; break;
+            case 'm': memoize = 1; break;
+            case 'O': optimize = 1; break;
+            case 'p': predict = 1; break;
+            case 't': trace_level = atoi(optarg); break;
+            case 'd': dump = 1; break;
+            default: usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if(!valid_engine(engine)) {
+        usage();
+    }
+    select_scanners();
+    if(trace_enabled(1)) {
+        error_dump = trace_dump;
+    }
+
+    if(image_file != NULL) {
+        if(argc != 1) {
+            usage();
+        } else {
+            Program program;
+            OptimizeStats optimized;
+            load_program(argv[0], &program);
+            if(optimize) {
+                optimize_program(&program, &optimized);
+            }
+            write_image(&program, image_file);
+            free_program(&program);
+        }
+    } else if(output_dir != NULL) {
+        if(argc < 2 || output_file != NULL || profile_file != NULL || reparse_file != NULL) {
+            usage();
+        } else {
+            Program program;
+            Batch batch;
+            OptimizeStats optimized;
+            PredictStats predicted;
+            double elapsed = 0;
+            long failed = 0;
+            long i = 0;
+            memset(&batch, 0, sizeof(batch));
+            load_program(argv[0], &program);
+            if(optimize) {
+                optimize_program(&program, &optimized);
+            }
+            if(predict) {
+                predict_program(&program, &predicted);
+            }
+            check_verified(&program);
+            batch.program = &program;
+            batch.engine = engine;
+            batch.memoize = memoize;
+            batch.stream = stream;
+            batch.output_dir = output_dir;
+            batch.inputs = argv + 1;
+            batch.inputs_len = argc - 1;
+            batch.results = calloc(batch.inputs_len, sizeof(BatchResult));
+            if(batch.results == NULL) {
+                fatal_error(error_memory, "Out of memory\n");
+            }
+            /*the trace ring is shared*/
+            if(jobs < 1 || trace_enabled(1)) {
+                jobs = 1;
+            }
+            if(jobs > batch.inputs_len) {
+                jobs = batch.inputs_len;
+            }
+
+            elapsed = seconds_now();
+            run_batch(&batch, jobs);
+            elapsed = seconds_now() - elapsed;
+            for(i = 0; i < batch.inputs_len; ++i) {
+                failed += batch.results[i].failed;
+            }
+            if(failed > 0) {
+                status = 1;
+            }
+
+            if(dump) {
+                trace_dump();
+            }
+            if(stats) {
+                long instructions = 0;
+                long calls = 0;
+                long bytes = 0;
+                for(i = 0; i < batch.inputs_len; ++i) {
+                    const BatchResult * const result = &batch.results[i];
+                    if(result->failed) {
+                        fprintf(stderr, "%s: failed\n", batch.inputs[i]);
+                        continue;
+                    }
+                    fprintf(stderr, "%s: ", batch.inputs[i]);
+                    print_stats(engine, result->instructions, result->calls, result->bytes, result->seconds);
+                    instructions += result->instructions;
+                    calls += result->calls;
+                    bytes += result->bytes;
+                }
+                fprintf(stderr, "batch files=%ld failed=%ld jobs=%ld ", batch.inputs_len, failed, jobs);
+                print_stats(engine, instructions, calls, bytes, elapsed);
+            }
+            free(batch.results);
+            free_program(&program);
+        }
+    } else if(argc != 2 || (reparse_file != NULL && (memoize || stream || profile_file != NULL))
+        || (split && (memoize || stream || profile_file != NULL || reparse_file != NULL))) {
+        usage();
+    } else {
+        const char * code_file= argv[0];
+        const char * input_file = argv[1];
+        double elapsed = 0;
+        Program program;
+        Meta2Vm vm = {0};
+        Memo memo;
+        Profile profile;
+        OptimizeStats optimized;
+        PredictStats predicted;
+        const int fd = output_file == NULL ? STDOUT_FILENO : open_output(output_file);
+        load_program(code_file, &program);
+        if(optimize) {
+            optimize_program(&program, &optimized);
+        }
+        if(predict) {
+            predict_program(&program, &predicted);
+        }
+        check_verified(&program);
+        vm.program = &program;
+        if(memoize) {
+            memo_init(&memo, &program);
+            vm.memo = &memo;
+        }
+        if(profile_file != NULL) {
+            /*only the switch engine has the hooks*/
+            engine = "switch";
+            profile_init(&profile, &program);
+            vm.profile = &profile;
+        }
+
+        if(reparse_file != NULL) {
+            engine = "switch";
+            elapsed = run_reparse(&vm, reparse_file, input_file, stats, fd);
+        } else if(split && jobs > 1 && !trace_enabled(1)) {
+            /*the trace ring is shared, and the jit cannot start in the
+              middle of the start rule*/
+            engine = strcmp(engine, "switch") == 0 ? "switch" : "threaded";
+            elapsed = run_split(&vm, engine, input_file, jobs, stats, fd);
+        } else {
+            elapsed = run_input(&vm, engine, input_file, stream, fd);
+        }
+        if(output_file != NULL) {
+            close(fd);
+        }
+
+        if(dump) {
+            trace_dump();
+        }
+        if(stats) {
+            print_stats(engine, vm.instructions, vm.calls, vm.input_offset + vm.input_len, elapsed);
+            if(optimize) {
+                optimize_report(&optimized);
+            }
+            if(predict) {
+                predict_report(&predicted, &vm);
+            }
+            if(memoize) {
+                memo_report(&memo, &program);
+            }
+        }
+        if(profile_file != NULL) {
+            profile_report(&profile, &program);
+            profile_write_folded(&profile, &program, profile_file);
+            profile_free(&profile);
+        }
+        if(memoize) {
+            memo_free(&memo);
+        }
+        free_program(&program);
+    }
+    return status;
+}
+
+#endif
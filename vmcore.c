@@ -0,0 +1,827 @@
+/*vm core, see vmcore.h*/
+#include "vmcore.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <errno.h>
+
+/*returns the next label number; counter is per run so every parse
+  numbers its labels from A0*/
+int gensym(int * counter) {
+    const int label = *counter;
+    *counter = label == INT_MAX ? 0 : label + 1;
+    return label;
+}
+
+THREAD_LOCAL ErrorHandler * error_handler = NULL;
+void (*error_dump)(void) = NULL;
+
+NORETURN
+void fatal_error(int code, const char * const fmt, ...) {
+    va_list args;
+    if(error_handler != NULL) {
+        va_start(args, fmt);
+        vsnprintf(error_handler->message, sizeof(error_handler->message), fmt, args);
+        va_end(args);
+        error_handler->code = code;
+        longjmp(error_handler->jump, 1);
+    }
+    fflush(stdout);
+    if(error_dump != NULL) {
+        error_dump();
+    }
+    fprintf(stderr, "Error: ");
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    abort();
+}
+
+/*maps a whole file read-only; the view is not NUL terminated, use *len*/
+const char * map_file(const char * filename, long * len) {
+    struct stat st;
+    const char * base = NULL;
+    int fd = -1;
+    assert(filename != NULL);
+    assert(len != NULL);
+    fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        fatal_error(error_io, "Failed to open \"%s\"\n", filename);
+    }
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        fatal_error(error_io, "Failed to open \"%s\"\n", filename);
+    }
+    *len = st.st_size;
+    if(st.st_size == 0) {
+        close(fd);
+        return "";
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        fatal_error(error_io, "Failed to map \"%s\"\n", filename);
+    }
+    posix_madvise((void *)base, st.st_size, POSIX_MADV_SEQUENTIAL);
+    return base;
+}
+
+void unmap_file(const char * base, long len) {
+    if(len > 0) {
+        munmap((void *)base, len);
+    }
+}
+
+/*opens filename, "-" for stdin, to be read through a Stream; regular files
+  are mapped instead unless force is set, then this returns 0*/
+int stream_open(Stream * self, const char * filename, int force) {
+    struct stat st;
+    memset(self, 0, sizeof(Stream));
+    self->fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+    if(self->fd < 0) {
+        fatal_error(error_io, "Failed to open \"%s\"\n", filename);
+    }
+    if(fstat(self->fd, &st) != 0) {
+        if(self->fd != STDIN_FILENO) {
+            close(self->fd);
+        }
+        fatal_error(error_io, "Failed to open \"%s\"\n", filename);
+    }
+    if(S_ISREG(st.st_mode) && !force && self->fd != STDIN_FILENO) {
+        close(self->fd);
+        return 0;
+    }
+    return 1;
+}
+
+void stream_close(Stream * self) {
+    if(self->fd != STDIN_FILENO) {
+        close(self->fd);
+    }
+    free(self->data);
+}
+
+double seconds_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void buffer_reserve(Buffer * self, long len) {
+    assert(self);
+    assert(len >= 0);
+    if(self->len + len > self->cap) {
+        long cap = self->cap > 0 ? self->cap : 64;
+        char * data = NULL;
+        while(cap < self->len + len) {
+            cap *= 2;
+        }
+        data = realloc(self->data, cap);
+        if(data == NULL) {
+            fatal_error(error_memory, "Out of memory\n");
+        }
+        self->data = data;
+        self->cap = cap;
+    }
+}
+
+void buffer_append(Buffer * self, const char * bytes, long len) {
+    if(len == 0) {
+        return;
+    }
+    buffer_reserve(self, len);
+    memcpy(&self->data[self->len], bytes, len);
+    self->len += len;
+}
+
+void buffer_free(Buffer * self) {
+    free(self->data);
+    memset(self, 0, sizeof(Buffer));
+}
+
+#define arena_block_cap (64 * 1024)
+#define arena_align(size) (((size) + 7) & ~7L)
+
+void * arena_alloc(Arena * self, long size) {
+    ArenaBlock * block = self->head;
+    assert(size >= 0);
+    size = arena_align(size);
+    if(block == NULL || block->used + size > block->cap) {
+        const long cap = size > arena_block_cap ? size : arena_block_cap;
+        block = malloc(sizeof(ArenaBlock) + cap);
+        if(block == NULL) {
+            fatal_error(error_memory, "Out of memory\n");
+        }
+        block->next = self->head;
+        block->used = 0;
+        block->cap = cap;
+        self->head = block;
+    }
+    {
+        void * result = (char *)(block + 1) + block->used;
+        block->used += size;
+        return result;
+    }
+}
+
+/*resizes an allocation, in place if it is the most recent one and fits*/
+void * arena_grow(Arena * self, void * old, long old_size, long new_size) {
+    ArenaBlock * block = self->head;
+    old_size = arena_align(old_size);
+    new_size = arena_align(new_size);
+    if(old != NULL && (char *)old + old_size == (char *)(block + 1) + block->used
+        && block->used - old_size + new_size <= block->cap) {
+        block->used += new_size - old_size;
+        return old;
+    } else {
+        void * result = arena_alloc(self, new_size);
+        if(old != NULL) {
+            memcpy(result, old, old_size < new_size ? old_size : new_size);
+        }
+        return result;
+    }
+}
+
+/*makes room for needed items in a growable arena array of *cap items*/
+void * arena_reserve(Arena * self, void * items, long * cap, long needed, long item_size) {
+    long new_cap = *cap > 0 ? *cap : 64;
+    if(needed <= *cap) {
+        return items;
+    }
+    while(new_cap < needed) {
+        new_cap *= 2;
+    }
+    items = arena_grow(self, items, *cap * item_size, new_cap * item_size);
+    *cap = new_cap;
+    return items;
+}
+
+void arena_free(Arena * self) {
+    while(self->head != NULL) {
+        ArenaBlock * next = self->head->next;
+        free(self->head);
+        self->head = next;
+    }
+}
+
+void write_all(int fd, const char * bytes, long len) {
+    while(len > 0) {
+        const long written = write(fd, bytes, len);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fatal_error(error_io, "Failed to write output: %s\n", strerror(errno));
+        }
+        bytes += written;
+        len -= written;
+    }
+}
+
+void sink_init(Sink * self, int fd) {
+    self->fd = fd;
+    self->len = 0;
+}
+
+void sink_flush(Sink * self) {
+    write_all(self->fd, self->data, self->len);
+    self->len = 0;
+}
+
+void sink_write(Sink * self, const char * bytes, long len) {
+    if(self->len + len > sink_cap) {
+        sink_flush(self);
+        if(len > sink_cap) {
+            /*too big to be worth buffering*/
+            write_all(self->fd, bytes, len);
+            return;
+        }
+    }
+    memcpy(&self->data[self->len], bytes, len);
+    self->len += len;
+}
+
+const unsigned char char_classes[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 0, 0, 0, 0, 0, 0,
+    0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0,
+    0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+/*scalar scanners: return the first byte in [str, end) outside the class*/
+
+const char * scan_class_scalar(const char * str, const char * end, int class) {
+    for(;str < end && char_is(*str, class); ++str);
+    return str;
+}
+
+const char * scan_space_scalar(const char * str, const char * end) {
+    return scan_class_scalar(str, end, class_space);
+}
+
+const char * scan_alnum_scalar(const char * str, const char * end) {
+    return scan_class_scalar(str, end, class_alnum);
+}
+
+const char * scan_digit_scalar(const char * str, const char * end) {
+    return scan_class_scalar(str, end, class_digit);
+}
+
+#ifdef HAVE_SIMD_SCANNERS
+
+#include <immintrin.h>
+
+/*SIMD scanners: classify 16 or 32 bytes per step, then finish the tail
+  with the table. Class membership is computed with unsigned range checks:
+  (ch - low) <= (high - low) holds exactly when min(ch - low, width) equals
+  ch - low.*/
+
+#define sse2_in_range(v, low, width) \
+    _mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8(v, _mm_set1_epi8(low)), _mm_set1_epi8(width)), \
+                   _mm_sub_epi8(v, _mm_set1_epi8(low)))
+
+__m128i sse2_space(__m128i v) {
+    return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), sse2_in_range(v, '\t', '\r' - '\t'));
+}
+
+__m128i sse2_digit(__m128i v) {
+    return sse2_in_range(v, '0', 9);
+}
+
+__m128i sse2_alnum(__m128i v) {
+    const __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    return _mm_or_si128(sse2_in_range(v, '0', 9), sse2_in_range(lower, 'a', 'z' - 'a'));
+}
+
+#define define_sse2_scanner(name, classify, class) \
+    const char * name(const char * str, const char * end) { \
+        for(;end - str >= 16; str += 16) { \
+            const int mask = _mm_movemask_epi8(classify(_mm_loadu_si128((const __m128i *)str))); \
+            if(mask != 0xffff) { \
+                return str + __builtin_ctz(~mask); \
+            } \
+        } \
+        return scan_class_scalar(str, end, class); \
+    }
+
+define_sse2_scanner(scan_space_sse2, sse2_space, class_space)
+define_sse2_scanner(scan_alnum_sse2, sse2_alnum, class_alnum)
+define_sse2_scanner(scan_digit_sse2, sse2_digit, class_digit)
+
+#define avx2_target __attribute__((target("avx2")))
+
+#define avx2_in_range(v, low, width) \
+    _mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_sub_epi8(v, _mm256_set1_epi8(low)), _mm256_set1_epi8(width)), \
+                      _mm256_sub_epi8(v, _mm256_set1_epi8(low)))
+
+avx2_target __m256i avx2_space(__m256i v) {
+    return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), avx2_in_range(v, '\t', '\r' - '\t'));
+}
+
+avx2_target __m256i avx2_digit(__m256i v) {
+    return avx2_in_range(v, '0', 9);
+}
+
+avx2_target __m256i avx2_alnum(__m256i v) {
+    const __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    return _mm256_or_si256(avx2_in_range(v, '0', 9), avx2_in_range(lower, 'a', 'z' - 'a'));
+}
+
+#define define_avx2_scanner(name, classify, tail) \
+    avx2_target const char * name(const char * str, const char * end) { \
+        for(;end - str >= 32; str += 32) { \
+            const unsigned mask = (unsigned)_mm256_movemask_epi8(classify(_mm256_loadu_si256((const __m256i *)str))); \
+            if(mask != 0xffffffffu) { \
+                return str + __builtin_ctz(~mask); \
+            } \
+        } \
+        return tail(str, end); \
+    }
+
+define_avx2_scanner(scan_space_avx2, avx2_space, scan_space_sse2)
+define_avx2_scanner(scan_alnum_avx2, avx2_alnum, scan_alnum_sse2)
+define_avx2_scanner(scan_digit_avx2, avx2_digit, scan_digit_sse2)
+
+#endif
+
+Scanners scanners = {"scalar", scan_space_scalar, scan_alnum_scalar, scan_digit_scalar};
+
+void select_scanners(void) {
+#ifdef HAVE_SIMD_SCANNERS
+    static const Scanners sse2 = {"sse2", scan_space_sse2, scan_alnum_sse2, scan_digit_sse2};
+    static const Scanners avx2 = {"avx2", scan_space_avx2, scan_alnum_avx2, scan_digit_avx2};
+    __builtin_cpu_init();
+    scanners = __builtin_cpu_supports("avx2") ? avx2 : sse2;
+#endif
+}
+
+/*operands of CHR, TOK and ANY, see compile_lexers in vm.c*/
+
+void compile_class(const char * spec, const char * end, CharSet * out) {
+    memset(out, 0, sizeof(CharSet));
+    while(spec < end) {
+        if(end - spec >= 3 && spec[1] == '-') {
+            int ch = 0;
+            for(ch = (unsigned char)spec[0]; ch <= (unsigned char)spec[2]; ++ch) {
+                charset_add(out, ch);
+            }
+            spec += 3;
+        } else {
+            charset_add(out, *spec);
+            ++spec;
+        }
+    }
+}
+
+/*the first and rest class of a CHR or TOK spec into out[0] and out[1]*/
+void compile_classes(const char * spec, const char * end, CharSet * out) {
+    const char * blank = spec;
+    while(blank < end && *blank != ' ') {
+        ++blank;
+    }
+    compile_class(spec, blank, &out[0]);
+    if(blank < end) {
+        compile_class(blank + 1, end, &out[1]);
+    } else {
+        out[1] = out[0];
+    }
+}
+
+int trie_node(Arena * arena, Trie * trie) {
+    trie->nodes = arena_reserve(arena, trie->nodes, &trie->cap, trie->len + 1, sizeof(TrieNode));
+    memset(&trie->nodes[trie->len], 0, sizeof(TrieNode));
+    return trie->len++;
+}
+
+/*adds the literals of an ANY spec to trie under a new root, returns it*/
+int compile_trie(Arena * arena, Trie * trie, const char * spec, const char * end) {
+    const int root = trie_node(arena, trie);
+    const char * word = spec;
+    while(word < end) {
+        int node = root;
+        for(; word < end && *word != ' '; ++word) {
+            const unsigned char ch = *word;
+            if(trie->nodes[node].next[ch] == 0) {
+                const int child = trie_node(arena, trie);
+                trie->nodes[node].next[ch] = child;
+            }
+            node = trie->nodes[node].next[ch];
+        }
+        trie->nodes[node].accept = node != root;
+        for(; word < end && *word == ' '; ++word);
+    }
+    return root;
+}
+
+/*vm utilities*/
+
+const char * vm_input(const Meta2Vm* self) {
+    assert(self);
+    assert(self->input_i >= 0);
+    assert(self->input_i <= self->input_len);
+    return &self->input[self->input_i];
+}
+
+/*number of input bytes left after input_i*/
+long vm_remaining(const Meta2Vm * self) {
+    return self->input_len - self->input_i;
+}
+
+/*absolute position of input_i, for the memo and messages*/
+long vm_position(const Meta2Vm * self) {
+    return self->input_offset + self->input_i;
+}
+
+/*streaming input
+
+  Input that is not a regular file, such as a pipe or "-" for stdin, is
+  read through a Stream instead of being mapped. The vm never moves back
+  in the input, so when a scan reaches the end of the window, vm_refill
+  drops everything before input_i, slides the rest to the front and reads
+  the next chunk. A scan stopped in the middle of a token carries on where
+  it was. The last token is kept too, CI copies it out of the window.
+  Memory stays at about two chunks unless a single token is longer.
+  Returns 0 at the end of the input.*/
+int vm_refill(Meta2Vm * self) {
+    Stream * const stream = self->stream;
+    long drop = 0;
+    long kept = 0;
+    long got = 0;
+    if(stream == NULL || stream->eof) {
+        return 0;
+    }
+    drop = self->input_i;
+    if(self->token_len > 0 && self->token - self->input_offset < drop) {
+        drop = self->token - self->input_offset;
+    }
+    kept = self->input_len - drop;
+    if(kept > 0) {
+        memmove(stream->data, &stream->data[drop], kept);
+    }
+    self->input_offset += drop;
+    self->input_i -= drop;
+    if(kept + stream_chunk > stream->cap) {
+        while(kept + stream_chunk > stream->cap) {
+            stream->cap = stream->cap > 0 ? stream->cap * 2 : 2 * stream_chunk;
+        }
+        stream->data = realloc(stream->data, stream->cap);
+        if(stream->data == NULL) {
+            fatal_error(error_memory, "Out of memory\n");
+        }
+    }
+    do {
+        got = read(stream->fd, &stream->data[kept], stream->cap - kept);
+    } while(got < 0 && errno == EINTR);
+    if(got < 0) {
+        fatal_error(error_io, "Failed to read input: %s\n", strerror(errno));
+    }
+    stream->eof = got == 0;
+    self->input = stream->data;
+    self->input_len = kept + got;
+    return got > 0;
+}
+
+/*makes len bytes available after input_i unless the input ends first*/
+void vm_fill(Meta2Vm * self, long len) {
+    while(vm_remaining(self) < len && vm_refill(self));
+}
+
+void vm_skip_whitespace(Meta2Vm* self) {
+    assert(self);
+    do {
+        self->input_i = scanners.space(vm_input(self), self->input + self->input_len) - self->input;
+    } while(self->input_i == self->input_len && vm_refill(self));
+}
+
+/*end of the run scan finds from input_i + from, read on through refills*/
+const char * vm_scan(Meta2Vm * self, ScanFn scan, long from) {
+    for(;;) {
+        const char * const limit = self->input + self->input_len;
+        const char * const end = scan(vm_input(self) + from, limit);
+        from = end - vm_input(self);
+        if(end < limit || !vm_refill(self)) {
+            return vm_input(self) + from;
+        }
+    }
+}
+
+void vm_advance(Meta2Vm * self, long i) {
+    assert(self);
+    assert(i > 0);
+    assert(self->input_i + i <= self->input_len && "Reached end of input");
+    self->input_i += i;
+}
+
+/*returns 0 at the end of the input*/
+char vm_peekch(const Meta2Vm * self) {
+    assert(self);
+    return self->input_i < self->input_len ? self->input[self->input_i] : 0;
+}
+
+/*makes [input_i, end) the token and advances past it; nothing is copied
+  until CI*/
+void vm_take_token(Meta2Vm * self, const char * end) {
+    const long len = end - vm_input(self);
+    assert(len > 0);
+    self->token = vm_position(self);
+    self->token_len = len;
+    ++self->token_serial;
+    vm_advance(self, len);
+}
+
+const char * vm_token(const Meta2Vm * self) {
+    assert(self->token >= self->input_offset);
+    return &self->input[self->token - self->input_offset];
+}
+
+/*doubles the vm stack; nesting is only limited by memory*/
+void vm_grow_stack(Meta2Vm * self) {
+    self->stack_cap = self->stack_cap > 0 ? self->stack_cap * 2 : 256;
+    self->stack = realloc(self->stack, self->stack_cap * sizeof(StackCell));
+    if(self->stack == NULL) {
+        fatal_error(error_memory, "Out of memory\n");
+    }
+}
+
+/*pushes the frame of a call that returns to return_address*/
+StackCell * vm_push_frame(Meta2Vm * self, int return_address) {
+    StackCell * frame = NULL;
+    if(self->stack_len == self->stack_cap) {
+        vm_grow_stack(self);
+    }
+    frame = &self->stack[self->stack_len];
+    frame->return_address = return_address;
+    frame->label1 = -1;
+    frame->label2 = -1;
+    self->stack_len += 1;
+    self->calls += 1;
+    return frame;
+}
+
+/*pops the top frame, returns its return address*/
+int vm_pop_frame(Meta2Vm * self) {
+    assert(self->stack_len > 0);
+    return self->stack[--self->stack_len].return_address;
+}
+
+/*label1, or label2 when second is set, of the top frame, generated on
+  first use*/
+int vm_frame_label(Meta2Vm * self, int second) {
+    int * label = NULL;
+    assert(self->stack_len > 0);
+    label = second ? &self->stack[self->stack_len - 1].label2 : &self->stack[self->stack_len - 1].label1;
+    if(*label < 0) {
+        *label = gensym(&self->label_counter);
+        ++self->effects;
+    }
+    return *label;
+}
+
+void vm_write_label(Meta2Vm * self, int label) {
+    char text[str_cap];
+    const char * const start = label_text(label, &text[str_cap]);
+    buffer_append(&self->record, start, &text[str_cap] - start);
+}
+
+void vm_copy_token(Meta2Vm * self) {
+    if(self->token_len > 0) {
+        buffer_append(&self->record, vm_token(self), self->token_len);
+    }
+}
+
+/*frees the stack and the output record*/
+void vm_release(Meta2Vm * self) {
+    free(self->stack);
+    buffer_free(&self->record);
+    self->stack = NULL;
+    self->stack_cap = 0;
+}
+
+/*opcode implementations*/
+void vm_tst(Meta2Vm* self, const char * str, long len) {
+    assert(self);
+    assert(str && "tst string is NULL");
+    assert(len > 0 && "empty string given as arg");
+    {
+        vm_skip_whitespace(self);
+        if(vm_remaining(self) < len) {
+            vm_fill(self, len);
+        }
+        if(vm_remaining(self) >= len && memcmp(str, vm_input(self), len) == 0) {
+            self->switch_flag = 1;
+            vm_advance(self, len);
+        } else {
+            self->switch_flag = 0;
+        }
+    }
+}
+
+void vm_id(Meta2Vm * self) {
+    assert(self);
+    vm_skip_whitespace(self);
+    if(!char_is(vm_peekch(self), class_alpha)) {
+        self->switch_flag = 0;
+    } else {
+        self->switch_flag = 1;
+        vm_take_token(self, vm_scan(self, scanners.alnum, 1));
+    }
+}
+
+
+void vm_num(Meta2Vm * self) {
+    assert(self);
+    vm_skip_whitespace(self);
+    if(!char_is(vm_peekch(self), class_digit)) {
+        self->switch_flag = 0;
+    } else {
+        self->switch_flag = 1;
+        vm_take_token(self, vm_scan(self, scanners.digit, 1));
+    }
+}
+
+void vm_sr(Meta2Vm * self) {
+    assert(self);
+    vm_skip_whitespace(self);
+    if(vm_peekch(self) != '\'') {
+        self->switch_flag = 0;
+    } else {
+        long from = 1;
+        const char * close = NULL;
+        while((close = memchr(vm_input(self) + from, '\'', vm_remaining(self) - from)) == NULL) {
+            from = vm_remaining(self);
+            if(!vm_refill(self)) {
+                fatal_error(error_syntax, "Unexpected end of input\n");
+            }
+        }
+        self->switch_flag = 1;
+        vm_take_token(self, close + 1);
+    }
+}
+
+void vm_chr(Meta2Vm * self, const CharSet * set) {
+    vm_skip_whitespace(self);
+    if(vm_remaining(self) == 0 || !charset_has(set, vm_peekch(self))) {
+        self->switch_flag = 0;
+    } else {
+        self->switch_flag = 1;
+        vm_take_token(self, vm_input(self) + 1);
+    }
+}
+
+/*classes[0] for the first character, classes[1] for the rest*/
+void vm_tok(Meta2Vm * self, const CharSet * classes) {
+    vm_skip_whitespace(self);
+    if(vm_remaining(self) == 0 || !charset_has(&classes[0], vm_peekch(self))) {
+        self->switch_flag = 0;
+    } else {
+        long i = 1;
+        do {
+            for(; i < vm_remaining(self) && charset_has(&classes[1], vm_input(self)[i]); ++i);
+        } while(i == vm_remaining(self) && vm_refill(self));
+        self->switch_flag = 1;
+        vm_take_token(self, vm_input(self) + i);
+    }
+}
+
+/*longest literal of the trie at root; a literal ending in a letter or
+  digit only matches where the word ends, so 'if' is not the start of "iffy"*/
+void vm_any(Meta2Vm * self, const TrieNode * trie, int root) {
+    long i = 0;
+    long match = 0;
+    int node = root;
+    int pending = 0; /*a literal ends at i, whether a word does is not known yet*/
+    vm_skip_whitespace(self);
+    do {
+        for(; i < vm_remaining(self); ++i) {
+            const char ch = vm_input(self)[i];
+            if(pending && !(char_is(ch, class_alnum) && char_is(vm_input(self)[i - 1], class_alnum))) {
+                match = i;
+            }
+            node = trie[node].next[(unsigned char)ch];
+            pending = node != 0 && trie[node].accept;
+            if(node == 0) {
+                break;
+            }
+        }
+    } while(i == vm_remaining(self) && vm_refill(self));
+    if(pending) {
+        match = i; /*at the end of the input*/
+    }
+    if(match == 0) {
+        self->switch_flag = 0;
+    } else {
+        self->switch_flag = 1;
+        vm_take_token(self, vm_input(self) + match);
+    }
+}
+
+
+void vm_set(Meta2Vm * self) {
+    assert(self);
+    self->switch_flag = 1;
+}
+
+void vm_be(const Meta2Vm * self) {
+    if(!self->switch_flag) {
+        fatal_error(error_syntax, "Syntax error at byte %ld of the input\n", vm_position(self));
+    }
+}
+
+void vm_cl(Meta2Vm * self, const char * literal, long len) {
+    buffer_append(&self->record, literal, len);
+}
+
+/*formats label as A<digits> so that it ends at end, returns the start*/
+char * label_text(int label, char * end) {
+    char * digit = end;
+    do {
+        *--digit = '0' + label % 10;
+        label /= 10;
+    } while(label > 0);
+    *--digit = 'A';
+    return digit;
+}
+
+void vm_lb(Meta2Vm * self) {
+    ++self->effects;
+    self->output_column = 0;
+}
+
+/*a record as OUT prints it, column blanks, the text and a newline, into
+  buffer, or into sink when buffer is NULL*/
+void write_record(Buffer * buffer, Sink * sink, int column, const char * record, long len) {
+    static const char blanks[instruction_column] = "       ";
+    assert(column >= 0 && column <= instruction_column);
+    if(buffer != NULL) {
+        buffer_append(buffer, blanks, column);
+        buffer_append(buffer, record, len);
+        buffer_append(buffer, "\n", 1);
+    } else {
+        assert(sink != NULL);
+        sink_write(sink, blanks, column);
+        sink_write(sink, record, len);
+        sink_write(sink, "\n", 1);
+    }
+}
+
+void vm_out(Meta2Vm * self) {
+    if(self->output != NULL) {
+        const int status = self->output(self->output_user, self->output_column, self->record.data, self->record.len);
+        if(status != 0) {
+            fatal_error(error_output, "Output callback returned %d\n", status);
+        }
+    } else {
+        assert(self->sink);
+        write_record(NULL, self->sink, self->output_column, self->record.data, self->record.len);
+    }
+    self->record.len = 0;
+    self->output_column = instruction_column;
+    ++self->effects;
+}
+
+int open_output(const char * filename) {
+    const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        fatal_error(error_io, "Failed to open \"%s\" for writing\n", filename);
+    }
+    return fd;
+}
+
+/*peak resident set size of the process in KiB*/
+long peak_rss_kb(void) {
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return usage.ru_maxrss;
+}
+
+/*the -s line, key=value fields so that bench/run.sh can collect them*/
+void print_stats(const char * engine, long instructions, long calls, long bytes, double seconds) {
+    fprintf(stderr, "engine=%s instructions=%ld calls=%ld seconds=%.6f ips=%.0f bytes=%ld mbps=%.2f maxrss_kb=%ld\n",
+        engine, instructions, calls, seconds, seconds > 0 ? instructions / seconds : 0.0,
+        bytes, seconds > 0 ? bytes / seconds / 1e6 : 0.0, peak_rss_kb());
+}
+
@@ -0,0 +1,285 @@
+#ifndef VMCORE_H
+#define VMCORE_H
+
+/*vm core: the state of a parse and the orders that act on it
+
+  Shared by the interpreter in vm.c and the native parsers meta2c.meta
+  generates (see meta/runtime.c), so both scan, generate labels and format
+  output the same way. vm.c builds vmcore.c into itself so its engines can
+  inline the orders; the native runtime links it. Whatever needs a
+  Program, the memo, reparse checkpoints or a parallel chunk, including
+  CLL, R, CI and GN1/GN2, stays in vm.c on top of the frame and label
+  functions here.*/
+
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <setjmp.h>
+
+#define str_cap 16
+
+#if defined(__GNUC__) || defined(__clang__)
+#define NORETURN __attribute__((noreturn))
+#define ALWAYS_INLINE __inline__ __attribute__((always_inline))
+#define THREAD_LOCAL __thread
+#else
+#define NORETURN
+#define ALWAYS_INLINE
+#define THREAD_LOCAL
+#endif
+
+/*errors
+
+  fatal_error prints the message and aborts, unless the thread installed
+  an ErrorHandler: then it longjmps there with the code and message, which
+  is how metac.c turns errors into return codes. Whatever a parse or a
+  load allocated must stay reachable from its vm or program, so the
+  handler can free it.*/
+
+enum {
+    error_program = 1, /*invalid program text or image*/
+    error_syntax,      /*the input is rejected*/
+    error_memory,
+    error_io,
+    error_output       /*the output callback asked to stop*/
+};
+
+#define error_message_cap 256
+
+typedef struct {
+    jmp_buf jump;
+    int code;
+    char message[error_message_cap];
+} ErrorHandler;
+
+extern THREAD_LOCAL ErrorHandler * error_handler;
+/*when set, called before an unhandled error aborts, see trace_dump*/
+extern void (*error_dump)(void);
+
+NORETURN
+void fatal_error(int code, const char * const fmt, ...);
+
+typedef struct ArenaBlock {
+    struct ArenaBlock * next;
+    long used;
+    long cap;
+} ArenaBlock;
+
+/*bump allocator, everything allocated from it is released at once*/
+typedef struct {
+    ArenaBlock * head;
+} Arena;
+
+/*set of bytes, used for FIRST sets*/
+typedef struct {
+    unsigned char bits[32];
+} CharSet;
+
+#define charset_has(set, ch) (((set)->bits[(unsigned char)(ch) >> 3] >> ((unsigned char)(ch) & 7)) & 1)
+#define charset_add(set, ch) ((set)->bits[(unsigned char)(ch) >> 3] |= 1 << ((unsigned char)(ch) & 7))
+
+/*literal set trie for ANY, node 0 is never a child so 0 means no edge*/
+typedef struct {
+    int next[256];
+    int accept; /*a literal ends here*/
+} TrieNode;
+
+/*tries being built in an arena, see compile_trie*/
+typedef struct {
+    TrieNode * nodes;
+    long len;
+    long cap;
+} Trie;
+
+typedef struct {
+    int return_address;
+    /*gensym numbers, -1 until GN1/GN2 generates them*/
+    int label1;
+    int label2;
+} StackCell;
+
+/*growable byte buffer*/
+typedef struct {
+    char * data;
+    long len;
+    long cap;
+} Buffer;
+
+#define sink_cap (1 << 16)
+
+/*block buffered writer for a file descriptor*/
+typedef struct {
+    int fd;
+    long len;
+    char data[sink_cap];
+} Sink;
+
+/*window over input read in chunks, see vm_refill*/
+typedef struct {
+    int fd;
+    int eof;
+    char * data;
+    long cap;
+} Stream;
+
+#define stream_chunk (64 * 1024)
+
+/*OUT writes records at this column unless LB moved the record to the label column*/
+#define instruction_column 7
+
+typedef struct {
+    const struct Program * program;
+    StackCell * stack; /*grows as calls nest, see vm_cll*/
+    long stack_len;
+    long stack_cap;
+    long token;     /*last token scanned, a span at this absolute input position*/
+    long token_len;
+    int switch_flag;
+    long instructions;
+    long calls;     /*frames CLL pushed, what inlining saves*/
+    int isp;
+
+    const char * input; /*not NUL terminated, bounded by input_len*/
+    long input_i;
+    long input_len;
+    Stream * stream;    /*NULL when the whole input is in memory*/
+    long input_offset;  /*bytes the stream dropped before input*/
+
+    Buffer record; /*output record being built by CL/CI/GN1/GN2*/
+    int output_column;
+    Sink * sink;
+    /*when set, OUT hands each record to output instead of the sink;
+      a nonzero return stops the parse*/
+    int (*output)(void * user, int column, const char * record, long len);
+    void * output_user;
+    int label_counter; /*for gensym*/
+
+    /*packrat memo mode, see memo_replay*/
+    struct Memo * memo;
+    long token_serial; /*bumped whenever the token changes*/
+    long effects;      /*bumped by anything a memo entry cannot replay*/
+
+    struct Profile * profile; /*-P, switch engine only*/
+    struct Reparse * reparse; /*checkpoints, see reparse_edit*/
+    struct Chunk * chunk;     /*one piece of a parallel parse, see run_split*/
+
+    /*FIRST-set prediction counters*/
+    long predicted_calls;  /*calls failed without entering the rule*/
+    long predicted_jumps;  /*dispatches that skipped alternatives*/
+
+    /*engine code built by the first run and reused, see free_vm*/
+    struct ThreadedOp * threaded;
+    struct Jit * jit;
+} Meta2Vm;
+
+/*character classes
+
+  A 256-entry table replaces the locale dependent <ctype.h> predicates; the
+  classes match the "C" locale's isspace, isalpha and isdigit.*/
+
+#define class_space 1
+#define class_alpha 2
+#define class_digit 4
+#define class_alnum (class_alpha | class_digit)
+
+extern const unsigned char char_classes[256];
+
+#define char_is(ch, class) (char_classes[(unsigned char)(ch)] & (class))
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_SIMD_SCANNERS 1
+#endif
+
+typedef const char * (*ScanFn)(const char * str, const char * end);
+
+/*the scanners used by the vm, picked once for the running cpu*/
+typedef struct {
+    const char * name;
+    ScanFn space;
+    ScanFn alnum;
+    ScanFn digit;
+} Scanners;
+
+extern Scanners scanners;
+
+int gensym(int * counter);
+
+const char * map_file(const char * filename, long * len);
+void unmap_file(const char * base, long len);
+int stream_open(Stream * self, const char * filename, int force);
+void stream_close(Stream * self);
+int open_output(const char * filename);
+double seconds_now(void);
+long peak_rss_kb(void);
+void print_stats(const char * engine, long instructions, long calls, long bytes, double seconds);
+
+void buffer_reserve(Buffer * self, long len);
+void buffer_append(Buffer * self, const char * bytes, long len);
+void buffer_free(Buffer * self);
+
+void * arena_alloc(Arena * self, long size);
+void * arena_grow(Arena * self, void * old, long old_size, long new_size);
+void * arena_reserve(Arena * self, void * items, long * cap, long needed, long item_size);
+void arena_free(Arena * self);
+
+void write_all(int fd, const char * bytes, long len);
+void sink_init(Sink * self, int fd);
+void sink_flush(Sink * self);
+void sink_write(Sink * self, const char * bytes, long len);
+void write_record(Buffer * buffer, Sink * sink, int column, const char * record, long len);
+
+const char * scan_class_scalar(const char * str, const char * end, int class);
+const char * scan_space_scalar(const char * str, const char * end);
+const char * scan_alnum_scalar(const char * str, const char * end);
+const char * scan_digit_scalar(const char * str, const char * end);
+#ifdef HAVE_SIMD_SCANNERS
+const char * scan_space_sse2(const char * str, const char * end);
+const char * scan_alnum_sse2(const char * str, const char * end);
+const char * scan_digit_sse2(const char * str, const char * end);
+/*only where __builtin_cpu_supports("avx2")*/
+const char * scan_space_avx2(const char * str, const char * end);
+const char * scan_alnum_avx2(const char * str, const char * end);
+const char * scan_digit_avx2(const char * str, const char * end);
+#endif
+void select_scanners(void);
+
+void compile_class(const char * spec, const char * end, CharSet * out);
+void compile_classes(const char * spec, const char * end, CharSet * out);
+int trie_node(Arena * arena, Trie * trie);
+int compile_trie(Arena * arena, Trie * trie, const char * spec, const char * end);
+
+const char * vm_input(const Meta2Vm * self);
+long vm_remaining(const Meta2Vm * self);
+long vm_position(const Meta2Vm * self);
+int vm_refill(Meta2Vm * self);
+void vm_fill(Meta2Vm * self, long len);
+void vm_skip_whitespace(Meta2Vm * self);
+const char * vm_scan(Meta2Vm * self, ScanFn scan, long from);
+void vm_advance(Meta2Vm * self, long i);
+char vm_peekch(const Meta2Vm * self);
+void vm_take_token(Meta2Vm * self, const char * end);
+const char * vm_token(const Meta2Vm * self);
+void vm_grow_stack(Meta2Vm * self);
+StackCell * vm_push_frame(Meta2Vm * self, int return_address);
+int vm_pop_frame(Meta2Vm * self);
+int vm_frame_label(Meta2Vm * self, int second);
+void vm_write_label(Meta2Vm * self, int label);
+void vm_copy_token(Meta2Vm * self);
+void vm_release(Meta2Vm * self);
+
+void vm_tst(Meta2Vm * self, const char * str, long len);
+void vm_id(Meta2Vm * self);
+void vm_num(Meta2Vm * self);
+void vm_sr(Meta2Vm * self);
+void vm_chr(Meta2Vm * self, const CharSet * set);
+void vm_tok(Meta2Vm * self, const CharSet * classes);
+void vm_any(Meta2Vm * self, const TrieNode * trie, int root);
+void vm_set(Meta2Vm * self);
+void vm_be(const Meta2Vm * self);
+void vm_cl(Meta2Vm * self, const char * literal, long len);
+char * label_text(int label, char * end);
+void vm_lb(Meta2Vm * self);
+void vm_out(Meta2Vm * self);
+
+#endif